@@ -3,8 +3,80 @@ import serial
 import time
 import tqdm
 import argparse
+import contextlib
 import datetime
+import mmap
+import os
 import pathlib
+import queue
+import shutil
+import struct
+import threading
+import zlib
+
+FRAME_MAGIC = 0xA5
+FRAME_PAGE = 0
+FRAME_ERROR = 1
+FRAME_END = 2
+FRAME_BBT = 3
+FRAME_BAD_BLOCK = 4
+FRAME_ERASED = 5
+FRAME_PAGE_RLE = 6
+FRAME_VOTE = 7
+FRAME_ECC = 8
+FRAME_HASH = 9
+FRAME_CAPTURE = 10
+
+DUMP_OPT_CACHE_READ = 0x1
+DUMP_OPT_SKIP_BAD = 0x2
+DUMP_OPT_ERASED = 0x4
+DUMP_OPT_RLE = 0x8
+DUMP_OPT_STRIPE = 0x10
+DUMP_OPT_ECC = 0x20
+DUMP_OPT_HASH = 0x40
+
+PROGRAM_OPT_CACHE = 0x1
+PROGRAM_OPT_SKIP_ERASED = 0x2
+
+# CMD_BENCH tests, in the order --bench runs them
+BENCH_BUS = 0
+BENCH_USB = 1
+BENCH_CMD_ADDR = 2
+BENCH_TR = 3
+
+# FRAME_HASH payload entry: page number (chip in the top byte), CRC32 of the page
+HASH_ENTRY = struct.Struct("<II")
+
+# FRAME_CAPTURE payload header: sample rate, number of samples, whether the read
+# went through, then the GPIO numbers of IO0, CLE, ALE, CE, RE, WE and RY
+CAPTURE_HDR = struct.Struct("<IIB7B")
+
+# FRAME_ECC payload byte of a sector with more bit flips than the BCH code corrects
+ECC_UNCORRECTABLE = 0xFF
+
+# with DUMP_OPT_STRIPE the top byte of a frame's page number is the chip
+FRAME_CHIP_SHIFT = 24
+FRAME_PAGE_MASK = (1 << FRAME_CHIP_SHIFT) - 1
+
+# magic, type, payload length, page number, crc32 of the page
+FRAME_HDR = struct.Struct("<BBHII")
+
+# pages per dump command in fast mode, the progress file is saved after each
+CHECKPOINT_PAGES = 4096
+
+# dump commands sent ahead of the one being received, so the device never waits
+# for the host between ranges. They queue up in the CDC receive buffer
+PIPELINE_DEPTH = 4
+
+# frames buffered between the serial reader thread and the writer
+FRAME_QUEUE_SIZE = 1024
+
+# per page status in a NandImage index
+PAGE_MISSING = 0
+PAGE_OK = 1
+PAGE_BAD_BLOCK = 2  # in a bad block, not read
+PAGE_FAILED = 3  # still failed after the retries, data is whatever arrived last
+PAGE_VOTED = 4  # majority of several reads
 
 
 def parse_args():
@@ -32,8 +104,8 @@ def parse_args():
         "-n",
         "--num-pages",
         type=int,
-        default=(64 * 2048),
-        help="Size of flash in pages.",
+        default=None,
+        help="Size of flash in pages (default: all of it, as reported by the dumper).",
     )
 
     parser.add_argument(
@@ -75,6 +147,124 @@ def parse_args():
         help="Use the super-slow page set method",
     )
 
+    parser.add_argument(
+        "-F",
+        "--fast",
+        action="store_true",
+        help="Stream the whole range as binary frames instead of one hex page per request",
+    )
+
+    parser.add_argument(
+        "-r",
+        "--resume",
+        action="store_true",
+        help="In fast mode, continue an interrupted dump into FILENAME using its .progress file",
+    )
+
+    parser.add_argument(
+        "--format",
+        choices=("flat", "image"),
+        default="flat",
+        help="In fast mode, 'flat' writes the pages as read (data and oob interleaved), "
+        "'image' a NandImage with header, separate data/oob regions, page index and bad block table",
+    )
+
+    parser.add_argument(
+        "--previous",
+        type=str,
+        default=None,
+        metavar="FILENAME",
+        help="In fast mode, start from a copy of an earlier dump of the same range and format, "
+        "and only fetch the pages whose on-device CRC differs from it",
+    )
+
+    parser.add_argument(
+        "--no-cache-read",
+        action="store_true",
+        help="In fast mode, read every page with a full page read instead of read cache sequential",
+    )
+
+    parser.add_argument(
+        "--stripe",
+        action="store_true",
+        help="In fast mode, dump every chip on the bus at once (interleaved), one output file per chip",
+    )
+
+    parser.add_argument(
+        "--no-compress",
+        action="store_true",
+        help="In fast mode, always send full pages instead of compressing erased pages and 0xFF runs",
+    )
+
+    parser.add_argument(
+        "--skip-bad",
+        action="store_true",
+        help="In fast mode, scan the bad block markers first and don't read bad blocks",
+    )
+
+    parser.add_argument(
+        "--ecc",
+        action="store_true",
+        help="In fast mode, BCH check every page on the device (8 bits per 512 bytes, ECC at the end of the OOB) and treat uncorrectable pages as failed",
+    )
+
+    parser.add_argument(
+        "--retries",
+        type=int,
+        default=3,
+        help="In fast mode, how many times to re-request pages that failed their CRC check",
+    )
+
+    parser.add_argument(
+        "--vote",
+        type=int,
+        default=5,
+        metavar="READS",
+        help="In fast mode, read pages that still fail after the retries READS times and take a per-bit majority vote (0 to disable)",
+    )
+
+    parser.add_argument(
+        "--bench",
+        type=int,
+        nargs="?",
+        const=256,
+        default=0,
+        metavar="PAGES",
+        help="Measure NAND bus, USB, command/address and tR speed separately over PAGES pages from the start page (default 256) and exit",
+    )
+
+    parser.add_argument(
+        "--clone",
+        default=None,
+        metavar="DUMP",
+        help="Write DUMP (flat or NandImage) onto the chip: erase the blocks, program the pages and verify them by CRC, then exit. "
+        "A flat dump goes to -s on, which has to be the start of a block",
+    )
+
+    parser.add_argument(
+        "--capture",
+        type=int,
+        default=None,
+        metavar="PAGE",
+        help="Sample the bus while the device reads PAGE, write it to the output file as a VCD and exit",
+    )
+
+    parser.add_argument(
+        "--capture-div",
+        type=int,
+        default=4,
+        metavar="DIV",
+        help="Capture sample rate is the system clock divided by DIV (default 4)",
+    )
+
+    parser.add_argument(
+        "--stats",
+        type=int,
+        default=0,
+        metavar="PAGES",
+        help="In fast mode, poll the on-device stats every PAGES pages and show them next to the progress bar",
+    )
+
     return parser.parse_args()
 
 
@@ -85,7 +275,7 @@ def reset_page_number(ser):
 def set_page_number(ser, page_no):
     p1 = page_no & 0xFF
     p2 = (page_no >> 8) & 0xFF
-    p3 = (page_no >> 16) & 0x1
+    p3 = (page_no >> 16) & 0xFF
     ser_cmd = b"3" + bytes([p1, p2, p3])
     ser.write(ser_cmd)
 
@@ -95,11 +285,694 @@ def read_page(ser, pagesize):
     return ser.read(pagesize * 2)
 
 
-def get_flash_sizes(ser):
+def dump_pages(ser, start_page, num_pages, options):
+    ser_cmd = (
+        b"7"
+        + start_page.to_bytes(3, "little")
+        + num_pages.to_bytes(3, "little")
+        + bytes([options])
+    )
+    ser.write(ser_cmd)
+
+
+def read_frame(ser):
+    hdr = ser.read(FRAME_HDR.size)
+    magic, frame_type, length, page_no, crc = FRAME_HDR.unpack(hdr)
+    if magic != FRAME_MAGIC:
+        raise RuntimeError(f"Lost frame sync (got {hdr.hex()})")
+    return frame_type, page_no, crc, ser.read(length)
+
+
+def rle_decode(payload):
+    """Expands a FRAME_PAGE_RLE payload: (u16 literal len, literal, u16 0xFF run len)..."""
+    page = bytearray()
+    pos = 0
+    while pos < len(payload):
+        (lit_len,) = struct.unpack_from("<H", payload, pos)
+        page += payload[pos + 2 : pos + 2 + lit_len]
+        pos += 2 + lit_len
+        (run_len,) = struct.unpack_from("<H", payload, pos)
+        page += b"\xff" * run_len
+        pos += 2
+    return bytes(page)
+
+
+def expand_page(frame_type, payload, page_size):
+    """Returns the full page for the frame types that carry one, else None"""
+    if frame_type == FRAME_PAGE:
+        return payload
+    if frame_type == FRAME_ERASED:
+        return b"\xff" * page_size
+    if frame_type == FRAME_PAGE_RLE:
+        return rle_decode(payload)
+    return None
+
+
+def scan_bad_blocks(ser):
+    """Returns (number of blocks, per chip the list of blocks with a bad block marker)"""
+    ser.write(b"c")
+    num_blocks, bad = 0, []
+    while True:
+        frame_type, page_no, crc, payload = read_frame(ser)
+        if frame_type == FRAME_END:
+            return num_blocks, bad
+        if frame_type != FRAME_BBT or zlib.crc32(payload) != crc or page_no >> FRAME_CHIP_SHIFT != len(bad):
+            raise RuntimeError("Bad block scan failed")
+        num_blocks = page_no & FRAME_PAGE_MASK
+        bad.append([b for b in range(num_blocks) if payload[b // 8] & (1 << (b % 8))])
+
+
+def vote_page(ser, page_no, votes, chip=0):
+    """Returns (majority voted page, number of unstable bits), or None if the page can't be read"""
+    ser.write(b"d" + page_no.to_bytes(3, "little") + bytes([votes, chip]))
+    frame_type, _, crc, payload = read_frame(ser)
+    if frame_type != FRAME_VOTE or zlib.crc32(payload[4:]) != crc:
+        return None
+    return payload[4:], int.from_bytes(payload[:4], "little")
+
+
+def read_key_values(ser):
+    """Reads "name: key=value ..." lines up to "end" into {name: {key: value}}"""
+    stats = {}
+    while True:
+        line = ser.readline().decode().strip()
+        if line == "end":
+            return stats
+        name, _, fields = line.rpartition(": ")
+        stats[name or "totals"] = {
+            k: v if k == "hist" else int(v)
+            for k, v in (f.split("=") for f in fields.split())
+        }
+
+
+def get_stats(ser, reset=False):
+    """Returns the device stats as {name: {key: value}}, e.g. stats["tR"]["avg_us"]"""
+    ser.write(b"b" + bytes([1 if reset else 0]))
+    return read_key_values(ser)
+
+
+def run_bench(ser, test, start_page, count):
+    """Runs one CMD_BENCH test, returns the device's numbers plus host_us (wall time
+    on this side) and host_bytes (data received, BENCH_USB only)"""
+    ser.write(b"e" + bytes([test]) + start_page.to_bytes(3, "little") + count.to_bytes(3, "little"))
+    host_start = time.monotonic()
+    host_bytes = 0
+    if test == BENCH_USB:
+        while True:
+            frame_type, _, _, payload = read_frame(ser)
+            host_bytes += FRAME_HDR.size + len(payload)
+            if frame_type == FRAME_END:
+                break
+    host_us = int((time.monotonic() - host_start) * 1e6)
+    (result,) = read_key_values(ser).values()
+    return dict(result, host_us=host_us, host_bytes=host_bytes)
+
+
+def bench(ser, start_page, count):
+    bus = run_bench(ser, BENCH_BUS, start_page, count)
+    print(f"NAND bus:     {bus['kb_per_sec'] / 1000:.2f} MB/s, {bus['total_us'] // max(bus['iterations'], 1)} us per page")
+    usb = run_bench(ser, BENCH_USB, start_page, count)
+    print(
+        f"USB:          {usb['host_bytes'] / max(usb['host_us'], 1):.2f} MB/s received "
+        f"({usb['kb_per_sec'] / 1000:.2f} MB/s into the CDC fifo)"
+    )
+    cmd_addr = run_bench(ser, BENCH_CMD_ADDR, start_page, count)
+    print(f"cmd + addr:   {cmd_addr['ns_per_iteration']} ns")
+    tr = run_bench(ser, BENCH_TR, start_page, count)
+    print(f"tR:           {tr['total_us'] // max(tr['iterations'], 1)} us (min {tr['min_us']}, max {tr['max_us']})")
+    for name, result in (("bus", bus), ("usb", usb), ("tR", tr)):
+        if result["timeouts"]:
+            print(f"Warning: {result['timeouts']} timeouts in the {name} test")
+
+
+def capture(ser, page_no, clkdiv):
+    """Returns (sample rate in Hz, read went through, {signal: gpio}, list of 32 bit samples)"""
+    ser.write(b"f" + page_no.to_bytes(3, "little") + clkdiv.to_bytes(2, "little"))
+    frame_type, _, crc, payload = read_frame(ser)
+    if frame_type != FRAME_CAPTURE or zlib.crc32(payload) != crc:
+        raise RuntimeError("Capture failed")
+    rate, count, read_ok, *gpios = CAPTURE_HDR.unpack_from(payload)
+    pins = dict(zip(("io", "CLE", "ALE", "CE_n", "RE_n", "WE_n", "RY"), gpios))
+    samples = struct.unpack_from(f"<{count}I", payload, CAPTURE_HDR.size)
+    return rate, bool(read_ok), pins, samples
+
+
+def write_vcd(f, rate, pins, samples):
+    """Writes the samples as a VCD, the control lines as wires and IO0-7 as one bus"""
+    signals = [(name, gpio) for name, gpio in pins.items() if name != "io"]
+    ids = {name: chr(ord("!") + i) for i, (name, _) in enumerate(signals)}
+    bus_id = chr(ord("!") + len(signals))
+    f.write("$timescale 1 ns $end\n$scope module nand $end\n")
+    for name, _ in signals:
+        f.write(f"$var wire 1 {ids[name]} {name} $end\n")
+    f.write(f"$var wire 8 {bus_id} IO $end\n$upscope $end\n$enddefinitions $end\n")
+
+    prev = None
+    for i, sample in enumerate(samples):
+        if sample == prev:
+            continue
+        f.write(f"#{i * 1_000_000_000 // rate}\n")
+        for name, gpio in signals:
+            bit = (sample >> gpio) & 1
+            if prev is None or bit != (prev >> gpio) & 1:
+                f.write(f"{bit}{ids[name]}\n")
+        io = (sample >> pins["io"]) & 0xFF
+        if prev is None or io != (prev >> pins["io"]) & 0xFF:
+            f.write(f"b{io:08b} {bus_id}\n")
+        prev = sample
+    f.write(f"#{len(samples) * 1_000_000_000 // rate}\n")
+
+
+def read_program_results(ser):
+    """Collects the answer to an erase or program command up to its FRAME_END.
+    Returns (failed, bad), page or block numbers"""
+    failed, bad = [], []
+    while True:
+        frame_type, page_no, _, _ = read_frame(ser)
+        if frame_type == FRAME_END:
+            return failed, bad
+        (bad if frame_type == FRAME_BAD_BLOCK else failed).append(page_no)
+
+
+def erase_blocks(ser, start_block, count):
+    ser.write(b"h" + start_block.to_bytes(3, "little") + count.to_bytes(3, "little"))
+    return read_program_results(ser)
+
+
+def program_pages(ser, start_page, pages, page_size, options):
+    """Streams pages (page_size bytes each, None for erased) to the device from a
+    writer thread while this one collects the results, so neither side waits on
+    the other. Returns (failed, bad)"""
+    erased = b"\xff" * page_size
+
+    def writer():
+        ser.write(b"i" + start_page.to_bytes(3, "little") + len(pages).to_bytes(3, "little") + bytes([options]))
+        for page in tqdm.tqdm(pages, desc="programming"):
+            ser.write(erased if page is None else page)
+
+    thread = threading.Thread(target=writer, daemon=True)
+    thread.start()
+    try:
+        return read_program_results(ser)
+    finally:
+        thread.join()
+
+
+def clone_source(f, page_size, start_page):
+    """Returns (first page, list of pages) to clone. A NandImage goes back where it
+    was dumped from, pages it doesn't hold a good read of are None (left erased).
+    A flat dump starts at start_page"""
+    try:
+        img = NandImage(f, writable=False)
+    except (ValueError, struct.error):
+        data = f.read()
+        return start_page, [data[i : i + page_size] for i in range(0, len(data) - page_size + 1, page_size)]
+    try:
+        if img.data_size + img.oob_size != page_size:
+            raise RuntimeError(f"Dump has {img.data_size + img.oob_size} byte pages, the chip {page_size}")
+        return img.start_page, [
+            bytes(img.data(i)) + bytes(img.oob(i)) if img.crc(i) is not None else None for i in range(img.num_pages)
+        ]
+    finally:
+        img.close()
+
+
+def clone(ser, args):
+    """Erase, program and verify. The verify pass is a hash dump (option 6): only
+    the page CRCs come back, compared with those of the dump. Returns the pages
+    that didn't end up as in the dump"""
+    data_size, oob_size, chip_size, _ = get_flash_geometry(ser)
+    page_size = data_size + oob_size
+    num_blocks, bad_blocks = scan_bad_blocks(ser)
+    bad_blocks = bad_blocks[0]  # clones go to chip 0
+    ppb = chip_size // page_size // num_blocks
+    with open(args.clone, "rb") as f:
+        start_page, pages = clone_source(f, page_size, args.start_page)
+    if args.num_pages is not None:
+        pages = pages[: args.num_pages]
+    if start_page % ppb:
+        raise RuntimeError(f"Page {start_page} isn't the start of a block ({ppb} pages per block)")
+    first_block = start_page // ppb
+    blocks = -(-len(pages) // ppb)
+    if first_block + blocks > num_blocks:
+        raise RuntimeError(f"{len(pages)} pages from page {start_page} don't fit on the chip")
+    print(f"Cloning {len(pages)} pages to blocks {first_block}-{first_block + blocks - 1}, {len(bad_blocks)} bad blocks are left alone")
+
+    start = time.monotonic()
+    failed_blocks, _ = erase_blocks(ser, first_block, blocks)
+    if failed_blocks:
+        print(f"Erase failed for blocks {failed_blocks}")
+    failed, _ = program_pages(ser, start_page, pages, page_size, PROGRAM_OPT_CACHE | PROGRAM_OPT_SKIP_ERASED)
+    if failed:
+        print(f"Program failed for {len(failed)} pages")
+    elapsed = time.monotonic() - start
+    print(f"Erased and programmed in {elapsed:.1f} s ({len(pages) * page_size / max(elapsed, 1e-3) / 1e6:.2f} MB/s)")
+
+    erased_crc = zlib.crc32(b"\xff" * page_size)
+    expected = {start_page + i: erased_crc if page is None else zlib.crc32(page) for i, page in enumerate(pages)}
+    options = DUMP_OPT_HASH | DUMP_OPT_SKIP_BAD | (0 if args.no_cache_read else DUMP_OPT_CACHE_READ)
+    dump_pages(ser, start_page, len(pages), options)
+    mismatched = []
+    while True:
+        frame_type, page_no, crc, payload = read_frame(ser)
+        if frame_type == FRAME_END:
+            break
+        if frame_type == FRAME_BAD_BLOCK:
+            del expected[page_no]  # not cloned, the dump has whatever was in the source's block
+        elif frame_type == FRAME_HASH and zlib.crc32(payload) == crc:
+            for page_no, page_crc in HASH_ENTRY.iter_unpack(payload):
+                if expected.pop(page_no) != page_crc:
+                    mismatched.append(page_no)
+    return sorted(mismatched + list(expected))  # anything without a CRC couldn't be read back
+
+
+def stats_postfix(stats):
+    return {
+        "pg/s": stats["totals"]["pages_per_sec"],
+        "tR": stats["tR"]["avg_us"],
+        "data": stats["data"]["avg_us"],
+        "usb": stats["usb"]["avg_us"],
+        "ry_to": stats["totals"]["ry_timeouts"],
+    }
+
+
+class Progress:
+    """Sidecar bitmap of the pages already written to a dump, so an interrupted
+    dump only has to fetch the pages that are missing. One bit per page and chip"""
+
+    # magic, start page, number of pages, page size, chips, followed by the bitmap
+    HDR = struct.Struct("<4sIIII")
+    MAGIC = b"NDPG"
+
+    def __init__(self, path, start_page, num_pages, page_size, num_chips=1):
+        self.path = pathlib.Path(str(path) + ".progress")
+        self.start_page = start_page
+        self.num_pages = num_pages
+        self.page_size = page_size
+        self.num_chips = num_chips
+        self.total = num_pages * num_chips
+        self.bitmap = bytearray((self.total + 7) // 8)
+
+    def header(self):
+        return self.HDR.pack(self.MAGIC, self.start_page, self.num_pages, self.page_size, self.num_chips)
+
+    def load(self):
+        """Returns False if there is no progress file matching this dump"""
+        try:
+            data = self.path.read_bytes()
+        except FileNotFoundError:
+            return False
+        if data[: self.HDR.size] != self.header():
+            return False
+        self.bitmap[:] = data[self.HDR.size :]
+        return True
+
+    def save(self):
+        tmp = self.path.with_suffix(".tmp")
+        tmp.write_bytes(self.header() + self.bitmap)
+        os.replace(tmp, self.path)
+
+    def remove(self):
+        self.path.unlink(missing_ok=True)
+
+    def _bit(self, page_no, chip):
+        return chip * self.num_pages + page_no - self.start_page
+
+    def mark(self, page_no, chip=0):
+        i = self._bit(page_no, chip)
+        self.bitmap[i // 8] |= 1 << (i % 8)
+
+    def unmark(self, page_no, chip=0):
+        i = self._bit(page_no, chip)
+        self.bitmap[i // 8] &= ~(1 << (i % 8))
+
+    def is_done(self, page_no, chip=0):
+        i = self._bit(page_no, chip)
+        return bool(self.bitmap[i // 8] & (1 << (i % 8)))
+
+    def page_done(self, page_no):
+        return all(self.is_done(page_no, chip) for chip in range(self.num_chips))
+
+    def num_done(self):
+        return sum(bin(b).count("1") for b in self.bitmap)
+
+    def missing_runs(self, max_len):
+        """Yields (first page, count) for every run of pages missing on any chip, at most max_len long"""
+        page_no = self.start_page
+        end = self.start_page + self.num_pages
+        while page_no < end:
+            if self.page_done(page_no):
+                page_no += 1
+                continue
+            run_start = page_no
+            while page_no < end and page_no - run_start < max_len and not self.page_done(page_no):
+                page_no += 1
+            yield run_start, page_no - run_start
+
+
+def chip_filename(filename, chip, num_chips):
+    """Output file of a chip: FILENAME itself for a single chip, else NAME_chipN.EXT"""
+    if num_chips == 1:
+        return pathlib.Path(filename)
+    path = pathlib.Path(filename)
+    return path.with_name(f"{path.stem}_chip{chip}{path.suffix}")
+
+
+class FlatImage:
+    """Pages as read, data and oob interleaved, sparse until written"""
+
+    def __init__(self, f, page_size, num_pages):
+        size = page_size * num_pages
+        f.truncate(size)
+        self.mm = mmap.mmap(f.fileno(), size)
+        self.page_size = page_size
+
+    def put(self, i, page, crc, status=PAGE_OK):
+        self.mm[i * self.page_size : i * self.page_size + len(page)] = page
+
+    def crc(self, i):
+        return zlib.crc32(self.mm[i * self.page_size : (i + 1) * self.page_size])
+
+    def set_status(self, i, status):
+        pass
+
+    def set_bbt(self, bad_blocks):
+        pass
+
+    def flush(self):
+        self.mm.flush()
+
+    def close(self):
+        self.mm.close()
+
+
+class NandImage:
+    """Dump laid out for zero copy access through an mmap: a header, then the data
+    of every page back to back, then every page's oob, a (u32 status, u32 crc32 of
+    data + oob) index entry per page and the bad block table (block n is bit n%8 of
+    byte n/8). Each region starts on an ALIGN boundary at the offset in the header.
+    Within a region entry i is page start_page + i"""
+
+    # magic, version, flags, ID bytes, data size, oob size, pages per block, blocks,
+    # start page, pages, chip, offset of the data, oob, index and bad block regions
+    HDR = struct.Struct("<8sII8sIIIIIIIQQQQ")
+    MAGIC = b"NANDIMG\0"
+    VERSION = 1
+    ALIGN = 4096
+    INDEX_ENTRY = struct.Struct("<II")
+    FLAGS_OFFSET = 12
+    FLAG_BBT = 0x1  # the bad block table has been filled in
+
+    @classmethod
+    def layout(cls, data_size, oob_size, num_pages, num_blocks):
+        """Returns the data, oob, index and bad block table offsets and the file size"""
+        offsets = []
+        pos = cls.HDR.size
+        for region in (num_pages * data_size, num_pages * oob_size, num_pages * cls.INDEX_ENTRY.size, (num_blocks + 7) // 8):
+            pos = -(-pos // cls.ALIGN) * cls.ALIGN
+            offsets.append(pos)
+            pos += region
+        return (*offsets, pos)
+
+    def __init__(self, f, geometry=None, writable=True):
+        """Maps the image in the open file f. With geometry, (ID bytes, data size, oob
+        size, pages per block, blocks, start page, pages, chip), a new one is laid out"""
+        if geometry is not None:
+            id_bytes, data_size, oob_size, ppb, num_blocks, start_page, num_pages, chip = geometry
+            *offsets, size = self.layout(data_size, oob_size, num_pages, num_blocks)
+            f.truncate(size)
+            self.mm = mmap.mmap(f.fileno(), size)
+            self.mm[: self.HDR.size] = self.HDR.pack(
+                self.MAGIC, self.VERSION, 0, id_bytes[:8].ljust(8, b"\0"), data_size, oob_size,
+                ppb, num_blocks, start_page, num_pages, chip, *offsets,
+            )
+        else:
+            self.mm = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_WRITE if writable else mmap.ACCESS_READ)
+
+        (magic, version, self.flags, self.id_bytes, self.data_size, self.oob_size, self.pages_per_block,
+         self.num_blocks, self.start_page, self.num_pages, self.chip,
+         self.data_off, self.oob_off, self.index_off, self.bbt_off) = self.HDR.unpack_from(self.mm)
+        if magic != self.MAGIC or version != self.VERSION:
+            raise ValueError("Not a NandImage")
+        self.view = memoryview(self.mm)
+
+    def data(self, i):
+        return self.view[self.data_off + i * self.data_size : self.data_off + (i + 1) * self.data_size]
+
+    def oob(self, i):
+        return self.view[self.oob_off + i * self.oob_size : self.oob_off + (i + 1) * self.oob_size]
+
+    def entry(self, i):
+        """Returns (status, crc32) of page start_page + i"""
+        return self.INDEX_ENTRY.unpack_from(self.mm, self.index_off + i * self.INDEX_ENTRY.size)
+
+    def crc(self, i):
+        """CRC32 of the page as it was dumped, None if it wasn't read fine"""
+        status, crc = self.entry(i)
+        return crc if status in (PAGE_OK, PAGE_VOTED) else None
+
+    def is_bad(self, block):
+        return bool(self.mm[self.bbt_off + block // 8] & (1 << (block % 8)))
+
+    def put(self, i, page, crc, status=PAGE_OK):
+        self.data(i)[:] = page[: self.data_size]
+        self.oob(i)[:] = page[self.data_size :]
+        self.INDEX_ENTRY.pack_into(self.mm, self.index_off + i * self.INDEX_ENTRY.size, status, crc)
+
+    def set_status(self, i, status):
+        struct.pack_into("<I", self.mm, self.index_off + i * self.INDEX_ENTRY.size, status)
+
+    def set_bbt(self, bad_blocks):
+        bbt = bytearray((self.num_blocks + 7) // 8)
+        for b in bad_blocks:
+            bbt[b // 8] |= 1 << (b % 8)
+        self.mm[self.bbt_off : self.bbt_off + len(bbt)] = bbt
+        self.flags |= self.FLAG_BBT
+        struct.pack_into("<I", self.mm, self.FLAGS_OFFSET, self.flags)
+
+    def flush(self):
+        self.mm.flush()
+
+    def close(self):
+        self.view.release()
+        self.mm.close()
+
+
+def write_page(outs, args, progress, page_no, chip, page, crc, status=PAGE_OK):
+    outs[chip].put(page_no - args.start_page, page, crc, status)
+    progress.mark(page_no, chip)
+
+
+def frame_reader(ser, runs, options, depth, frames, stop, poll_stats):
+    """Reader thread: keeps up to depth dump commands in flight and puts every frame
+    on frames. After each FRAME_END it optionally puts ("stats", ...), None at the end"""
+    try:
+        runs = iter(runs)
+        in_flight = 0
+        for run_start, count in runs:
+            dump_pages(ser, run_start, count, options)
+            in_flight += 1
+            if in_flight == depth:
+                break
+
+        while in_flight:
+            frame = read_frame(ser)
+            frames.put(frame)
+            if frame[0] != FRAME_END:
+                continue
+
+            in_flight -= 1
+            if poll_stats:
+                frames.put(("stats", get_stats(ser)))  # depth is 1, nothing else in flight
+            run = None if stop.is_set() else next(runs, None)
+            if run is not None:
+                dump_pages(ser, *run, options)
+                in_flight += 1
+        frames.put(None)
+    except Exception as e:
+        frames.put(e)
+
+
+def pipelined_dump(ser, args, outs, progress, runs, options, bar=None):
+    """Streams runs of (first page, count) into outs (one per chip), returns
+    ([(page, chip) that failed], number of pages in bad blocks, bit flips corrected)"""
+    failed_pages = []
+    skipped_pages = 0
+    ecc_bits = 0
+    frames = queue.Queue(maxsize=FRAME_QUEUE_SIZE)
+    stop = threading.Event()
+    poll_stats = args.stats > 0 and bar is not None
+    reader = threading.Thread(
+        target=frame_reader,
+        args=(ser, runs, options, 1 if poll_stats else PIPELINE_DEPTH, frames, stop, poll_stats),
+        daemon=True,
+    )
+    reader.start()
+
+    try:
+        while True:
+            frame = frames.get()
+            if frame is None:
+                break
+            if isinstance(frame, Exception):
+                raise frame
+            if frame[0] == "stats":
+                bar.set_postfix(stats_postfix(frame[1]))
+                continue
+
+            frame_type, page_no, crc, payload = frame
+            if frame_type == FRAME_END:
+                for out in outs:
+                    out.flush()  # data on disk before the progress file says so
+                progress.save()
+                continue
+
+            chip = page_no >> FRAME_CHIP_SHIFT
+            page_no &= FRAME_PAGE_MASK
+            if frame_type == FRAME_ECC:
+                # follows the page it is about, which has been written as read. Not
+                # done though, so a resume fetches it again if the retries don't happen
+                if ECC_UNCORRECTABLE in payload:
+                    progress.unmark(page_no, chip)
+                    failed_pages.append((page_no, chip))
+                else:
+                    ecc_bits += sum(payload)
+                continue
+
+            page = expand_page(frame_type, payload, args.page_size)
+            if page is not None and zlib.crc32(page) == crc:
+                write_page(outs, args, progress, page_no, chip, page, crc)
+            elif frame_type == FRAME_BAD_BLOCK:
+                outs[chip].set_status(page_no - args.start_page, PAGE_BAD_BLOCK)
+                skipped_pages += 1
+            else:
+                failed_pages.append((page_no, chip))
+            if bar is not None:
+                bar.update()
+    finally:
+        stop.set()
+
+    reader.join()
+    return list(dict.fromkeys(failed_pages)), skipped_pages, ecc_bits
+
+
+def mark_unchanged(ser, args, outs, progress):
+    """Has the device hash the whole range (dump option 6, only page CRCs come back)
+    and marks every page that matches the previous dump copied into outs as done.
+    Returns the number of unchanged pages"""
+    options = DUMP_OPT_HASH | (0 if args.no_cache_read else DUMP_OPT_CACHE_READ)
+    if args.stripe:
+        options |= DUMP_OPT_STRIPE
+    dump_pages(ser, args.start_page, args.num_pages, options)
+
+    unchanged = 0
+    with tqdm.tqdm(total=progress.total, desc="hashing") as bar:
+        while True:
+            frame_type, count, crc, payload = read_frame(ser)
+            if frame_type == FRAME_END:
+                break
+            if frame_type != FRAME_HASH:
+                bar.update()  # unreadable page, fetched again by the dump
+                continue
+            if zlib.crc32(payload) == crc:
+                for page_no, page_crc in HASH_ENTRY.iter_unpack(payload):
+                    chip = page_no >> FRAME_CHIP_SHIFT
+                    page_no &= FRAME_PAGE_MASK
+                    if outs[chip].crc(page_no - args.start_page) == page_crc:
+                        progress.mark(page_no, chip)
+                        unchanged += 1
+            bar.update(count)
+    return unchanged
+
+
+def fast_dump(ser, args, outs, progress):
+    options = 0 if args.no_cache_read else DUMP_OPT_CACHE_READ
+    if args.stripe:
+        options |= DUMP_OPT_STRIPE
+    if not args.no_compress:
+        options |= DUMP_OPT_ERASED | DUMP_OPT_RLE
+    if args.ecc:
+        options |= DUMP_OPT_ECC
+    if args.skip_bad:
+        _, bad_blocks = args.bbt or scan_bad_blocks(ser)
+        for chip, bad in enumerate(bad_blocks[: args.num_chips]):
+            print(f"{len(bad)} bad blocks{f' on chip {chip}' if args.num_chips > 1 else ''}: {bad[:16]}")
+        options |= DUMP_OPT_SKIP_BAD
+    chunk = args.stats if args.stats > 0 else CHECKPOINT_PAGES
+    if args.stats:
+        get_stats(ser, reset=True)
+
+    runs = list(progress.missing_runs(chunk))
+    with tqdm.tqdm(total=progress.total, initial=progress.num_done()) as bar:
+        bad_pages, skipped_pages, ecc_bits = pipelined_dump(ser, args, outs, progress, runs, options, bar)
+    if args.ecc:
+        print(f"ECC: {ecc_bits} correctable bit flips")
+
+    # pages whose CRC didn't match (or that couldn't be read, or were uncorrectable) are asked for again
+    for attempt in range(args.retries):
+        if not bad_pages:
+            break
+        print(f"Retrying {len(bad_pages)} pages ({attempt + 1}/{args.retries})")
+        runs = [(page_no, 1) for page_no in sorted({page_no for page_no, _ in bad_pages})]
+        bad_pages = pipelined_dump(ser, args, outs, progress, runs, options)[0]
+
+    # whatever is left reads differently every time, take the most likely value of each bit
+    if bad_pages and args.vote:
+        retry, bad_pages = bad_pages, []
+        for page_no, chip in retry:
+            voted = vote_page(ser, page_no, args.vote, chip)
+            if voted is None:
+                bad_pages.append((page_no, chip))
+                continue
+            page, unstable_bits = voted
+            print(f"Page {page_no}: majority of {args.vote} reads, {unstable_bits} unstable bits")
+            write_page(outs, args, progress, page_no, chip, page, zlib.crc32(page), PAGE_VOTED)
+        progress.save()
+
+    if skipped_pages:
+        print(f"Skipped {skipped_pages} pages in bad blocks")
+    if bad_pages:
+        print(f"Warning: {len(bad_pages)} pages failed: {bad_pages[:16]}")
+        for page_no, chip in bad_pages:
+            outs[chip].set_status(page_no - args.start_page, PAGE_FAILED)
+    if progress.num_done() == progress.total:
+        progress.remove()
+    else:
+        print(f"{progress.total - progress.num_done()} pages missing, rerun with --resume to fetch them")
+
+
+def probe(ser, timeout=2.0):
+    """Has the device identify the chip(s) again, so a swapped chip is picked up
+    without replugging. The device keeps a tuned timing scale if the same part
+    answers. Returns the status, e.g. OK, ID 98 dc 90 26 76 chips 1"""
+    ser.write(b"g")
+    deadline = time.monotonic() + timeout
+    saved_timeout, ser.timeout = ser.timeout, 0.1
+    try:
+        while time.monotonic() < deadline:
+            line = ser.readline().decode(errors="replace").strip()
+            if line.startswith("Probe: "):  # skips anything still buffered from before
+                break
+        else:
+            raise RuntimeError(f"No answer to the probe command within {timeout} s")
+    finally:
+        ser.timeout = saved_timeout
+    status = line[len("Probe: "):]
+    if not status.startswith("OK"):
+        raise RuntimeError(f"NAND probe failed: {status}")
+    return status
+
+
+def get_flash_geometry(ser):
+    """Returns (data size, oob size, bytes per chip including oob, chips)"""
     ser.write(b"5")
     time.sleep(0.1)
-    page_size, oob_size, total_size = ser.read_all().split(b",")
-    return int(page_size) + int(oob_size), int(total_size)
+    return tuple(int(v) for v in ser.read_all().split(b","))
+
+
+def get_flash_sizes(ser):
+    page_size, oob_size, total_size, num_chips = get_flash_geometry(ser)
+    return page_size + oob_size, total_size, num_chips
 
 
 def get_flash_info(ser):
@@ -108,6 +981,13 @@ def get_flash_info(ser):
     return ser.read_all().decode()
 
 
+def get_id_bytes(ser):
+    for line in get_flash_info(ser).splitlines():
+        if line.startswith("ID:"):
+            return bytes.fromhex(line[3:])
+    raise RuntimeError("No ID bytes in the read ID answer")
+
+
 def main():
     args = parse_args()
 
@@ -116,35 +996,124 @@ def main():
         if not output_dir.exists():
             output_dir.mkdir()
         ts = datetime.datetime.now().strftime("%m_%d_%y_%H:%M:%S")
-        args.filename = output_dir / pathlib.Path(f"dump_{ts}.dat")
+        suffix = "vcd" if args.capture is not None else "nimg" if args.format == "image" else "dat"
+        args.filename = output_dir / pathlib.Path(f"dump_{ts}.{suffix}")
 
     with serial.Serial(args.devname, baudrate=args.baudrate) as s:
         try:
             s.read_all()
-            time.sleep(0.5)
+            print(f"Probe: {probe(s)}")
 
             if args.info:
                 print(get_flash_info(s))
                 return
 
+            if args.bench:
+                bench(s, args.start_page, args.bench)
+                return
+
+            if args.clone is not None:
+                mismatched = clone(s, args)
+                if mismatched:
+                    raise RuntimeError(f"Verify failed for {len(mismatched)} pages, first {mismatched[:16]}")
+                print("Verified")
+                return
+
+            if args.capture is not None:
+                rate, read_ok, pins, samples = capture(s, args.capture, args.capture_div)
+                with open(args.filename, "w") as wf:
+                    write_vcd(wf, rate, pins, samples)
+                print(
+                    f"{len(samples)} samples at {rate / 1e6:.1f} MHz "
+                    f"({len(samples) * 1e6 / rate:.1f} us) written to {args.filename}"
+                )
+                if not read_ok:
+                    print("Warning: the read timed out waiting for RY")
+                return
+
+            num_chips = None
             if args.page_size is None:
                 print(f"Getting page size automatically...")
-                args.page_size, flash_size_b = get_flash_sizes(s)
+                args.page_size, flash_size_b, num_chips = get_flash_sizes(s)
                 print(f"Got page size (total bytes): {args.page_size}")
                 print(f"Got flash size (total bytes): {flash_size_b}")
-                if args.num_pages != flash_size_b // args.page_size:
+                if args.num_pages is not None and args.num_pages != flash_size_b // args.page_size:
                     print(
                         f"Warning: calculated pages != calculated number"
                         f"of pages {args.page_size} vs "
                         f"{flash_size_b // args.page_size}."
                     )
 
+            if args.num_pages is None:
+                args.num_pages = get_flash_sizes(s)[1] // args.page_size - args.start_page
+
+            args.num_chips = 1
+            if args.stripe:
+                args.num_chips = num_chips or get_flash_sizes(s)[2]
+                print(f"Striping across {args.num_chips} chips")
+
             print(
                 f"Dumping {args.num_pages} pages of size "
                 f"{args.page_size} to {args.filename}. "
                 f"Starting from page {args.start_page}"
             )
 
+            if args.fast:
+                args.bbt = None
+                if args.format == "image":
+                    id_bytes = get_id_bytes(s)
+                    data_size, oob_size, chip_size, _ = get_flash_geometry(s)
+                    args.bbt = scan_bad_blocks(s)
+                    num_blocks = args.bbt[0]
+                    ppb = chip_size // (data_size + oob_size) // num_blocks
+                    print(f"{num_blocks} blocks of {ppb} pages, {len(args.bbt[1][0])} bad")
+
+                filenames = [chip_filename(args.filename, c, args.num_chips) for c in range(args.num_chips)]
+                progress = Progress(args.filename, args.start_page, args.num_pages, args.page_size, args.num_chips)
+                resume = args.resume and all(f.exists() for f in filenames) and progress.load()
+                if resume:
+                    print(f"Resuming, {progress.total - progress.num_done()} pages left")
+                elif args.resume:
+                    print("Nothing to resume, starting over")
+
+                # an earlier dump is the starting point, the hashes decide what is fetched again
+                incremental = args.previous is not None and not resume
+                if incremental:
+                    for c, f in enumerate(filenames):
+                        prev = chip_filename(args.previous, c, args.num_chips)
+                        if prev.resolve() == f.resolve():
+                            raise RuntimeError("--previous has to be a different file")
+                        shutil.copyfile(prev, f)
+
+                # sparse files of the final size, pages are copied into place through an mmap
+                with contextlib.ExitStack() as stack:
+                    outs = []
+                    for c, f in enumerate(filenames):
+                        wf = stack.enter_context(open(f, "r+b" if resume or incremental else "w+b"))
+                        if args.format == "image":
+                            geometry = (id_bytes, data_size, oob_size, ppb, num_blocks, args.start_page, args.num_pages, c)
+                            out = NandImage(wf, None if resume or incremental else geometry)
+                            if (out.start_page, out.num_pages, out.data_size, out.oob_size) != geometry[5:7] + geometry[1:3]:
+                                raise RuntimeError(f"{f} doesn't hold this range of this chip")
+                        else:
+                            out = FlatImage(wf, args.page_size, args.num_pages)
+                        stack.callback(out.close)
+                        outs.append(out)
+                    if args.bbt:
+                        for out, bad in zip(outs, args.bbt[1]):
+                            out.set_bbt(bad)
+                    if incremental:
+                        unchanged = mark_unchanged(s, args, outs, progress)
+                        print(f"{unchanged} of {progress.total} pages unchanged since {args.previous}")
+                    try:
+                        fast_dump(s, args, outs, progress)
+                    finally:
+                        for out in outs:
+                            out.flush()
+                        if progress.num_done() < progress.total:
+                            progress.save()
+                return
+
             set_page_number(s, args.start_page)
 
             with open(args.filename, "wb") as wf:
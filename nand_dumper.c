@@ -3,12 +3,21 @@ Copyright (c) 2024 hexstd
 SPDX-License-Identifier: BSD-3-Clause
 */
 
+#include "hardware/clocks.h"
+#include "hardware/dma.h"
 #include "hardware/gpio.h"
+#include "hardware/pio.h"
+#include "hardware/structs/sio.h"
+#include "hardware/vreg.h"
+#include "nand.pio.h"
 #include "pico/error.h"
 #include "pico/multicore.h"
 #include "pico/platform.h"
 #include "pico/stdlib.h"
+#include "pico/stdio_usb.h"
 #include "pico/util/queue.h"
+#include "tusb.h"
+#include <assert.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
@@ -66,17 +75,25 @@ Organization x8
 // readData
 //   \___
 
+// Chips sharing IO/ALE/CLE/WE/RE/WP, each with its own CE and RY/BY
+#define MAX_CHIPS 2
+
 typedef struct {
     int io_start; // io pin start offset
 
     int ale; // address latch enable (EN_HI)
     int cle; // command latch enable (EN_HI)
 
-    int ce; // chip enable      (EN_LO)
+    int ce; // chip enable      (EN_LO) of the selected chip
     int re; // read enable      (EN_LO)
     int we; // write enable     (EN_LO)
     int wp; // write protect    (EN_LO)
-    int ry; // read busy        (EN_HI if viewed as "ready", EN_LO if viewed as "busy")
+    int ry; // read busy        (EN_HI if viewed as "ready", EN_LO if viewed as "busy") of the selected chip
+
+    int chip; // selected chip, ce and ry are chip_ce[chip] and chip_ry[chip]
+    int num_chips; // chips found by the last probe
+    int chip_ce[MAX_CHIPS];
+    int chip_ry[MAX_CHIPS];
 } nand_pins_t;
 
 typedef struct {
@@ -94,19 +111,75 @@ typedef enum cmd_enum {
     CMD_SET_PAGE_NO = 3,
     CMD_GET_DRIVE_STRENGTH = 4,
     CMD_GET_FLASH_INFO = 5,
-    CMD_NONE
+    CMD_SET_READ_MODE = 6,
+    CMD_DUMP_PAGES = 7, // core0 only, streams pages using CMD_READ_RANGE
+    CMD_TUNE_TIMING = 8,
+    CMD_SET_TIMING_SCALE = 9,
+    CMD_SET_SYS_CLOCK = 10, // 'a', commands past 9 continue with lower case letters
+    CMD_GET_STATS = 11,
+    CMD_SCAN_BAD_BLOCKS = 12,
+    CMD_VOTE_PAGE = 13,
+    CMD_BENCH = 14,
+    CMD_CAPTURE = 15,
+    CMD_PROBE = 16,
+    CMD_ERASE = 17,
+    CMD_PROGRAM = 18, // core0 streams the pages to core1 using CMD_PROGRAM_RANGE
+    CMD_NONE,
+
+    // core0 -> core1 only, not reachable from the console
+    CMD_READ_RANGE = 0x80,
+    CMD_PROGRAM_RANGE = 0x81,
 } cmd_enum_t;
 
 typedef struct {
     cmd_enum_t cmd;
     uint32_t arg;
+    uint32_t count; // CMD_READ_RANGE/CMD_PROGRAM_RANGE/CMD_BENCH: number of pages starting at arg,
+                    // CMD_ERASE: number of blocks, CMD_VOTE_PAGE: number of reads
+    uint8_t options; // CMD_READ_RANGE: DUMP_OPT_* flags, CMD_PROGRAM_RANGE: PROGRAM_OPT_*, CMD_BENCH: bench_mode_t,
+                     // CMD_VOTE_PAGE: chip
+    // CMD_CAPTURE: arg is the page, count the capture clock divider
 } cmd_t;
 
+// CMD_READ_PAGE arg flags
+#define READ_FLAG_CACHE 0x1 // page is part of a read cache sequential run
+#define READ_FLAG_LAST 0x2 // last page of the run, end it with 0x3F
+
+// CMD_DUMP_PAGES options byte
+#define DUMP_OPT_CACHE_READ 0x1 // use read cache sequential (0x31/0x3F) within each block
+#define DUMP_OPT_SKIP_BAD 0x2 // don't read blocks with a bad block marker, send FRAME_BAD_BLOCK instead
+#define DUMP_OPT_ERASED 0x4 // send all 0xFF pages as FRAME_ERASED
+#define DUMP_OPT_RLE 0x8 // send pages with long 0xFF runs as FRAME_PAGE_RLE
+#define DUMP_OPT_STRIPE 0x10 // read every page from all chips, interleaved, see read_range_striped()
+#define DUMP_OPT_ECC 0x20 // BCH check every page on core0 and follow pages with bit flips by a FRAME_ECC
+#define DUMP_OPT_HASH 0x40 // send FRAME_HASH lists of page CRCs instead of the pages
+
+// CMD_PROGRAM options byte
+#define PROGRAM_OPT_CACHE 0x1 // use cache program (0x15) within each block
+#define PROGRAM_OPT_SKIP_ERASED 0x2 // leave pages that are all 0xFF alone, erased already reads like that
+
+typedef enum result_status_enum {
+    RESULT_OK = 0,
+    RESULT_TIMEOUT = 1, // RY never came back, the chip has been reset
+    RESULT_BAD_BLOCK = 2, // page is in a block marked bad and wasn't read
+    RESULT_FAIL = 3, // the chip reported a failed program/erase
+} result_status_t;
+
 typedef struct {
     int sz;
-    void* alloc;
+    result_status_t status;
+    uint32_t page; // page that was read for CMD_READ_PAGE, block for CMD_ERASE
+    bool erased; // CMD_READ_RANGE with DUMP_OPT_ERASED: every byte of the page is 0xFF
+    uint32_t crc; // CRC32 of the page data, computed while it was read
+    uint32_t unstable_bits; // CMD_VOTE_PAGE: bits that didn't read the same every time
+    uint8_t* alloc; // pool buffer holding the data, owned by whoever holds the result. NULL if there is none
 } result_t;
 
+typedef enum read_mode_enum {
+    READ_MODE_BITBANG = 0, // RE toggled and IO sampled by the CPU
+    READ_MODE_PIO = 1, // RE strobed and IO sampled by the nand_read PIO program
+} read_mode_t;
+
 void* malloc(size_t n); // silence IDE warnings
 void* memset(void* data, int val, unsigned int n);
 void free(void*);
@@ -118,24 +191,291 @@ char HELP_STR[] = "Commands: \n\
 2: reset page - reset the page number to read\n\
 3: set page - set the page number to specific offset\n\
 4: get drive strength - get drive strength of pins\n\
+5: flash info - page size, oob size, total size of one chip and number of chips\n\
+6: read mode - next byte selects how pages are read (0 = bit-banged, 1 = PIO)\n\
+7: dump - next 3 bytes start page, 3 bytes page count (LE), 1 byte options. Streams binary frames\n\
+8: tune timing - next 3 bytes a page (LE) to verify against while sweeping the timing scale down\n\
+9: set timing scale - next 2 bytes (LE) the datasheet timing multiplier in percent\n\
+a: set sys clock - next 2 bytes (LE) clk_sys in MHz, bus timing is rescaled to match\n\
+b: stats - time spent per stage of page reads/dumps. Next byte 1 = reset after printing\n\
+c: scan bad blocks - checks every block's bad block marker, answers with a FRAME_BBT frame per chip and a FRAME_END\n\
+d: vote read - next 3 bytes a page (LE), 1 byte number of reads (odd, 3-15), 1 byte chip. Answers with a FRAME_VOTE frame\n\
+e: bench - next byte the test (0 = bus, 1 = usb, 2 = cmd/addr, 3 = tR), 3 bytes start page, 3 bytes count (LE)\n\
+f: capture - next 3 bytes a page, 2 bytes a clock divider (LE). Samples the bus while reading the page, answers with a FRAME_CAPTURE frame\n\
+g: probe - resets and identifies the chip(s) again, e.g. after swapping them\n\
+h: erase - next 3 bytes start block, 3 bytes block count (LE). Answers with frames for the blocks that failed or are bad\n\
+i: program - next 3 bytes start page, 3 bytes page count (LE), 1 byte options, then the pages (data + oob). Answers like h\n\
 else: help - Display this help string\n";
 
 const uint32_t LED_PIN = 25;
 
+// Bounds for RY/BY polling. tR and tDCBSYR are tens of us, a reset can take
+// up to 500us if it interrupts a program/erase
+const uint32_t READY_TIMEOUT_US = 1000;
+const uint32_t RESET_TIMEOUT_US = 600;
+
+// PIO state machine doing serial data output (see nand.pio) and the DMA
+// channel draining its RX FIFO into the page buffer
+const PIO nand_pio = pio0;
+uint nand_read_sm = 0;
+uint nand_dma_chan = 0;
+
+// Logic capture (nand_capture in nand.pio) for CMD_CAPTURE, own SM and DMA channel
+uint nand_capture_sm = 0;
+uint capture_dma_chan = 0;
+read_mode_t read_mode_glob = READ_MODE_PIO;
+
+/// Bus timing of a chip in ns, straight from the AC characteristics table of its datasheet
+typedef struct {
+    uint16_t t_cls; // CLE setup
+    uint16_t t_clh; // CLE hold
+    uint16_t t_als; // ALE setup
+    uint16_t t_alh; // ALE hold
+    uint16_t t_cs; // CE setup
+    uint16_t t_ds; // data setup
+    uint16_t t_dh; // data hold
+    uint16_t t_wp; // WE pulse width
+    uint16_t t_wh; // WE high hold
+    uint16_t t_wc; // write cycle
+    uint16_t t_wb; // WE high to busy
+    uint16_t t_whr; // WE high to RE low
+    uint16_t t_adl; // last address cycle to first data input (program)
+    uint16_t t_rr; // ready to RE low
+    uint16_t t_rp; // RE pulse width
+    uint16_t t_reh; // RE high hold
+    uint16_t t_rea; // RE access time
+    uint16_t t_rc; // read cycle
+} nand_timing_t;
+
+// ONFI timing modes 0-5 (SDR). Mode 0 is safe for anything we don't have a
+// datasheet for, ONFI chips report what else they support in their parameter page
+#define NUM_ONFI_TIMING_MODES 6
+
+const nand_timing_t TIMING_ONFI_MODES[NUM_ONFI_TIMING_MODES] = {
+    { .t_cls = 50, .t_clh = 20, .t_als = 50, .t_alh = 20, .t_cs = 70,
+        .t_ds = 40, .t_dh = 20, .t_wp = 50, .t_wh = 30, .t_wc = 100,
+        .t_wb = 200, .t_whr = 120, .t_adl = 200, .t_rr = 40,
+        .t_rp = 50, .t_reh = 30, .t_rea = 40, .t_rc = 100 },
+    { .t_cls = 25, .t_clh = 10, .t_als = 25, .t_alh = 10, .t_cs = 35,
+        .t_ds = 20, .t_dh = 10, .t_wp = 25, .t_wh = 15, .t_wc = 45,
+        .t_wb = 100, .t_whr = 80, .t_adl = 100, .t_rr = 20,
+        .t_rp = 25, .t_reh = 15, .t_rea = 30, .t_rc = 50 },
+    { .t_cls = 15, .t_clh = 10, .t_als = 15, .t_alh = 10, .t_cs = 25,
+        .t_ds = 15, .t_dh = 5, .t_wp = 17, .t_wh = 15, .t_wc = 35,
+        .t_wb = 100, .t_whr = 80, .t_adl = 100, .t_rr = 20,
+        .t_rp = 17, .t_reh = 15, .t_rea = 25, .t_rc = 35 },
+    { .t_cls = 10, .t_clh = 5, .t_als = 10, .t_alh = 5, .t_cs = 25,
+        .t_ds = 10, .t_dh = 5, .t_wp = 15, .t_wh = 10, .t_wc = 30,
+        .t_wb = 100, .t_whr = 60, .t_adl = 100, .t_rr = 20,
+        .t_rp = 15, .t_reh = 10, .t_rea = 20, .t_rc = 30 },
+    { .t_cls = 10, .t_clh = 5, .t_als = 10, .t_alh = 5, .t_cs = 20,
+        .t_ds = 10, .t_dh = 5, .t_wp = 12, .t_wh = 10, .t_wc = 25,
+        .t_wb = 100, .t_whr = 60, .t_adl = 70, .t_rr = 20,
+        .t_rp = 12, .t_reh = 10, .t_rea = 20, .t_rc = 25 },
+    { .t_cls = 10, .t_clh = 5, .t_als = 10, .t_alh = 5, .t_cs = 15,
+        .t_ds = 7, .t_dh = 5, .t_wp = 10, .t_wh = 7, .t_wc = 20,
+        .t_wb = 100, .t_whr = 60, .t_adl = 70, .t_rr = 20,
+        .t_rp = 10, .t_reh = 7, .t_rea = 16, .t_rc = 20 },
+};
+
+// TC58NVG2S0HBAI6 / TC58NVG1S3HBAI6
+const nand_timing_t TIMING_TOSHIBA_TC58 = {
+    .t_cls = 12, .t_clh = 5, .t_als = 12, .t_alh = 5, .t_cs = 20,
+    .t_ds = 12, .t_dh = 5, .t_wp = 12, .t_wh = 10, .t_wc = 25,
+    .t_wb = 100, .t_whr = 60, .t_adl = 300, .t_rr = 20,
+    .t_rp = 12, .t_reh = 10, .t_rea = 20, .t_rc = 25
+};
+
+/// The same timing turned into busy_wait_at_least_cycles() counts for the current
+/// clk_sys, grouped the way the bus routines use them
+typedef struct {
+    uint32_t cmd_setup; // CE/CLE/IO valid to WE low
+    uint32_t addr_setup; // CE/ALE valid before the first address cycle
+    uint32_t data_setup; // IO valid to WE low
+    uint32_t we_low;
+    uint32_t we_high; // between address cycles
+    uint32_t latch_hold; // WE high to CLE/ALE low
+    uint32_t wb; // WE high until RY can be trusted
+    uint32_t rr; // ready to RE low
+    uint32_t whr; // WE high to RE low
+    uint32_t adl; // last address cycle to data input
+    uint32_t re_low; // RE low to sampling IO
+    uint32_t re_high;
+    float pio_clkdiv; // nand_read SM clock divider
+} nand_cycles_t;
+
+// Datasheet timing is multiplied by this (in percent). The default leaves the same
+// kind of margin the original hand tuned delays had, CMD_TUNE_TIMING sweeps it down
+#define DEFAULT_TIMING_SCALE_PCT 200
+
+const nand_timing_t* timing_glob = &TIMING_ONFI_MODES[0];
+uint32_t timing_scale_pct = DEFAULT_TIMING_SCALE_PCT;
+nand_cycles_t __scratch_x("nand") cycles_glob = { 0 }; // read by core1 for every strobe, see core1_main()
+
+uint32_t ns_to_cycles(uint32_t ns, uint32_t scale_pct, uint32_t clk_hz)
+{
+    uint64_t scaled_ns = (uint64_t)ns * scale_pct;
+    return (uint32_t)((scaled_ns * clk_hz + 100000000000ull - 1) / 100000000000ull);
+}
+
+void compute_cycles(const nand_timing_t* t, uint32_t scale_pct, uint32_t clk_hz, nand_cycles_t* cyc)
+{
+    cyc->cmd_setup = ns_to_cycles(MAX(MAX(t->t_cls, t->t_cs), t->t_ds), scale_pct, clk_hz);
+    cyc->addr_setup = ns_to_cycles(MAX(t->t_als, t->t_cs), scale_pct, clk_hz);
+    cyc->data_setup = ns_to_cycles(t->t_ds > t->t_wp ? t->t_ds - t->t_wp : 0, scale_pct, clk_hz);
+    cyc->we_low = ns_to_cycles(t->t_wp, scale_pct, clk_hz);
+    cyc->we_high = ns_to_cycles(MAX(MAX(t->t_wh, t->t_dh), t->t_wc - t->t_wp), scale_pct, clk_hz);
+    cyc->latch_hold = ns_to_cycles(MAX(MAX(t->t_clh, t->t_alh), t->t_dh), scale_pct, clk_hz);
+    cyc->wb = ns_to_cycles(t->t_wb, scale_pct, clk_hz);
+    cyc->rr = ns_to_cycles(t->t_rr, scale_pct, clk_hz);
+    cyc->whr = ns_to_cycles(t->t_whr, scale_pct, clk_hz);
+    cyc->adl = ns_to_cycles(t->t_adl, scale_pct, clk_hz);
+
+    uint32_t re_low_ns = MAX(t->t_rea, t->t_rp);
+    cyc->re_low = ns_to_cycles(re_low_ns, scale_pct, clk_hz);
+    cyc->re_high = ns_to_cycles(MAX(t->t_reh, t->t_rc > re_low_ns ? t->t_rc - re_low_ns : 0), scale_pct, clk_hz);
+
+    // shortest SM cycle that meets every limit of the nand_read program (see nand.pio)
+    float sm_cycle_ns = MAX(MAX((float)t->t_rea / NAND_READ_REA_CYCLES, (float)t->t_rp / NAND_READ_RP_CYCLES),
+        MAX((float)t->t_reh / NAND_READ_REH_CYCLES, (float)t->t_rc / NAND_READ_RC_CYCLES));
+    float clkdiv = sm_cycle_ns * scale_pct / 100.0f * (float)clk_hz / 1e9f;
+    cyc->pio_clkdiv = clkdiv < 1.0f ? 1.0f : (clkdiv > 65535.0f ? 65535.0f : clkdiv);
+}
+
+/// Where the time goes. Core1 fills in the bus stages for every page read, core0
+/// the USB stage for every frame of a dump. Histogram bucket i counts samples
+/// below 2^i us, the last bucket everything above
+#define STATS_HIST_BUCKETS 12
+
+typedef enum stage_enum {
+    STAGE_SETUP, // command/address cycles
+    STAGE_TR, // waiting on RY (tR, tDCBSYR)
+    STAGE_DATA, // clocking the page out
+    STAGE_USB, // handing the frame to USB
+    NUM_STAGES
+} stage_t;
+
+const char* STAGE_NAMES[NUM_STAGES] = { "setup", "tR", "data", "usb" };
+
+typedef struct {
+    uint64_t total_us;
+    uint32_t count;
+    uint32_t min_us;
+    uint32_t max_us;
+    uint32_t hist[STATS_HIST_BUCKETS];
+} stage_stats_t;
+
+typedef struct {
+    stage_stats_t stage[NUM_STAGES];
+    uint32_t pages_read; // core1
+    uint32_t ry_timeouts; // core1
+    uint32_t pages_sent; // core0
+    uint32_t ecc_bits; // core0, bit flips found by DUMP_OPT_ECC
+    uint32_t ecc_uncorrectable; // core0, sectors with more than BCH_T
+    uint64_t dump_us; // core0, wall time spent in dumps
+} nand_stats_t;
+
+nand_stats_t stats_glob = { 0 };
+
+// when start_data_out() last saw RY go high, splits tR from data time
+uint64_t data_ready_us = 0;
+
+void reset_stats()
+{
+    memset(&stats_glob, 0, sizeof(stats_glob));
+    for (int i = 0; i < NUM_STAGES; i++) {
+        stats_glob.stage[i].min_us = UINT32_MAX;
+    }
+}
+
+void stats_add(stage_t stage, uint32_t us)
+{
+    stage_stats_t* st = &stats_glob.stage[stage];
+    int bucket = us ? 32 - __builtin_clz(us) : 0;
+
+    st->total_us += us;
+    st->count++;
+    st->min_us = MIN(st->min_us, us);
+    st->max_us = MAX(st->max_us, us);
+    st->hist[MIN(bucket, STATS_HIST_BUCKETS - 1)]++;
+}
+
+// setup_us/extra_tr_us are what the caller measured itself, the last RY wait
+// started at issued_us and data output ended now
+void stats_record_page(uint32_t setup_us, uint32_t extra_tr_us, uint64_t issued_us)
+{
+    uint64_t now = time_us_64();
+
+    stats_add(STAGE_SETUP, setup_us);
+    stats_add(STAGE_TR, extra_tr_us + (uint32_t)(data_ready_us - issued_us));
+    stats_add(STAGE_DATA, (uint32_t)(now - data_ready_us));
+    stats_glob.pages_read++;
+}
+
+void print_stats()
+{
+    for (int i = 0; i < NUM_STAGES; i++) {
+        stage_stats_t* st = &stats_glob.stage[i];
+        printf("%s: count=%lu total_us=%llu min_us=%lu max_us=%lu avg_us=%lu hist=", STAGE_NAMES[i],
+            (unsigned long)st->count, (unsigned long long)st->total_us,
+            (unsigned long)(st->count ? st->min_us : 0), (unsigned long)st->max_us,
+            (unsigned long)(st->count ? st->total_us / st->count : 0));
+        for (int j = 0; j < STATS_HIST_BUCKETS; j++) {
+            printf("%s%lu", j ? "," : "", (unsigned long)st->hist[j]);
+        }
+        printf("\n");
+    }
+
+    uint64_t pages_per_sec = stats_glob.dump_us ? (uint64_t)stats_glob.pages_sent * 1000000 / stats_glob.dump_us : 0;
+    printf("pages_read=%lu pages_sent=%lu ry_timeouts=%lu dump_us=%llu pages_per_sec=%lu ecc_bits=%lu ecc_uncorrectable=%lu\n",
+        (unsigned long)stats_glob.pages_read, (unsigned long)stats_glob.pages_sent,
+        (unsigned long)stats_glob.ry_timeouts, (unsigned long long)stats_glob.dump_us,
+        (unsigned long)pages_per_sec, (unsigned long)stats_glob.ecc_bits,
+        (unsigned long)stats_glob.ecc_uncorrectable);
+    printf("end\n");
+}
+
+// Default pinout, see set_gpios()
+#define DEFAULT_PIN_CLE 22
+#define DEFAULT_PIN_ALE 21 // pico pin 11
+#define DEFAULT_PIN_RE 19
+#define DEFAULT_PIN_WE 18
+#define DEFAULT_PIN_WP 17
+
 void set_gpios(nand_pins_t* pins)
 {
 
     pins->io_start = 0; // pico physical pins 1,2,4,5,6,7,9,10 (GP0-7). Setting this here makes math super easy
 
-    pins->cle = 22;
-    pins->ale = 21; // pico pin 11
+    pins->cle = DEFAULT_PIN_CLE;
+    pins->ale = DEFAULT_PIN_ALE;
+
+    pins->re = DEFAULT_PIN_RE;
+    pins->we = DEFAULT_PIN_WE;
+    pins->wp = DEFAULT_PIN_WP;
+
+    pins->chip_ce[0] = 20; // pico pin 14
+    pins->chip_ry[0] = 16; // pico pin 19
+    pins->chip_ce[1] = 26; // pico pin 31, second chip or die
+    pins->chip_ry[1] = 27; // pico pin 32
 
-    pins->ce = 20; // pico pin 14
-    pins->re = 19;
-    pins->we = 18;
-    pins->wp = 17;
+    pins->num_chips = 1; // until the others have been probed
+    pins->chip = 0;
+    pins->ce = pins->chip_ce[0];
+    pins->ry = pins->chip_ry[0];
+}
 
-    pins->ry = 16; // pico pin 19
+// Deselects the current chip (an operation it has in progress carries on with CE
+// high) and points ce/ry at another one
+void select_chip(nand_pins_t* pins, int chip)
+{
+    if (chip == pins->chip) {
+        return;
+    }
+    gpio_put(pins->ce, true);
+    pins->chip = chip;
+    pins->ce = pins->chip_ce[chip];
+    pins->ry = pins->chip_ry[chip];
 }
 
 void set_drive_strengths(nand_pins_t* pins, enum gpio_drive_strength strength)
@@ -146,7 +486,9 @@ void set_drive_strengths(nand_pins_t* pins, enum gpio_drive_strength strength)
     gpio_set_drive_strength(pins->ale, strength);
     gpio_set_drive_strength(pins->cle, strength);
 
-    gpio_set_drive_strength(pins->ce, strength);
+    for (int i = 0; i < MAX_CHIPS; i++) {
+        gpio_set_drive_strength(pins->chip_ce[i], strength);
+    }
     gpio_set_drive_strength(pins->re, strength);
     gpio_set_drive_strength(pins->we, strength);
     gpio_set_drive_strength(pins->wp, strength);
@@ -160,29 +502,31 @@ void init_gpios(nand_pins_t* pins, enum gpio_drive_strength init_strength)
     gpio_init(pins->ale);
     gpio_init(pins->cle);
 
-    gpio_init(pins->ce);
+    for (int i = 0; i < MAX_CHIPS; i++) {
+        gpio_init(pins->chip_ce[i]);
+        gpio_init(pins->chip_ry[i]);
+        gpio_set_pulls(pins->chip_ry[i], true, false);
+        gpio_set_dir(pins->chip_ce[i], true);
+        gpio_put(pins->chip_ce[i], true); // start with all chips disabled
+        gpio_set_dir(pins->chip_ry[i], false);
+    }
     gpio_init(pins->re);
     gpio_init(pins->we);
     gpio_init(pins->wp);
-    gpio_init(pins->ry);
     gpio_init(LED_PIN);
-    gpio_set_pulls(pins->ry, true, false);
 
     gpio_set_dir_out_masked(0xFF);
     gpio_set_dir(pins->ale, true);
     gpio_set_dir(pins->cle, true);
 
-    gpio_set_dir(pins->ce, true);
     gpio_set_dir(pins->re, true);
     gpio_set_dir(pins->we, true);
     gpio_set_dir(pins->wp, true);
-    gpio_set_dir(pins->ry, false);
 
     gpio_set_dir(LED_PIN, true);
 
     gpio_put(pins->ale, false);
     gpio_put(pins->cle, false);
-    gpio_put(pins->ce, true); // start with chip disabled
     gpio_put(pins->we, true);
     gpio_put(pins->re, true);
     gpio_put(pins->wp, true); // no write protect anymore
@@ -191,129 +535,434 @@ void init_gpios(nand_pins_t* pins, enum gpio_drive_strength init_strength)
     set_drive_strengths(pins, init_strength);
 }
 
-void set_io_dir(nand_pins_t* pins, bool to_output)
+/// Control lines are driven straight through the SIO set/clear registers, so every
+/// edge of a command or address cycle is one or two stores however many lines
+/// change. With NAND_FIXED_PINOUT (cmake -DNAND_FIXED_PINOUT=1) the masks are the
+/// default pinout as constants, otherwise they come from pins. CE always follows
+/// select_chip(). IO0-7 are GP0-7 either way
+#if NAND_FIXED_PINOUT
+#define CLE_MASK(pins) (1u << DEFAULT_PIN_CLE)
+#define ALE_MASK(pins) (1u << DEFAULT_PIN_ALE)
+#define RE_MASK(pins) (1u << DEFAULT_PIN_RE)
+#define WE_MASK(pins) (1u << DEFAULT_PIN_WE)
+#else
+#define CLE_MASK(pins) (1u << (pins)->cle)
+#define ALE_MASK(pins) (1u << (pins)->ale)
+#define RE_MASK(pins) (1u << (pins)->re)
+#define WE_MASK(pins) (1u << (pins)->we)
+#endif
+#define CE_MASK(pins) (1u << (pins)->ce)
+#define IO_MASK 0x000000FFu
+
+/// The bus routines from here down to read_data(), the page reads and core1_main()
+/// run from SRAM (__time_critical_func). Executing from XIP flash, a cache miss in
+/// the middle of a cycle counted delay stretches it by however long the refill
+/// takes, and core0's USB work keeps evicting the cache
+void __time_critical_func(set_io_dir)(nand_pins_t* pins, bool to_output)
 {
     if (to_output) {
-        gpio_set_dir_out_masked(0x000000FF);
+        sio_hw->gpio_oe_set = IO_MASK;
     } else {
-        gpio_set_dir_in_masked(0x000000FF);
+        sio_hw->gpio_oe_clr = IO_MASK;
     }
 }
 
-void set_io_val(nand_pins_t* pins, uint8_t io_val)
+void __time_critical_func(set_io_val)(nand_pins_t* pins, uint8_t io_val)
 {
-    gpio_put_masked(0x000000FF, (uint32_t)io_val);
+    sio_hw->gpio_set = io_val;
+    sio_hw->gpio_clr = ~(uint32_t)io_val & IO_MASK;
 }
 
-uint8_t get_io_val(nand_pins_t* pins)
+uint8_t __time_critical_func(get_io_val)(nand_pins_t* pins)
 {
-    return gpio_get_all() & 0xFF;
+    return sio_hw->gpio_in & IO_MASK;
 }
 
-void write_cmd(nand_pins_t* pins, uint8_t cmd)
+void __time_critical_func(write_cmd)(nand_pins_t* pins, uint8_t cmd)
 {
-    gpio_put(pins->re, true);
-    gpio_put(pins->we, true);
-    gpio_put(pins->ale, false);
+    // RE/WE idle high, CLE up, ALE down, CE down, cmd on IO0-7
+    sio_hw->gpio_set = RE_MASK(pins) | WE_MASK(pins) | CLE_MASK(pins) | cmd;
+    sio_hw->gpio_clr = ALE_MASK(pins) | CE_MASK(pins) | (~(uint32_t)cmd & IO_MASK);
     set_io_dir(pins, true);
-    set_io_val(pins, cmd);
-    gpio_put(pins->cle, true);
-    gpio_put(pins->ce, false);
-    busy_wait_at_least_cycles(5); // at least 20ns from CE low to WE high
+    busy_wait_at_least_cycles(cycles_glob.cmd_setup); // tCS/tCLS/tDS
 
-    gpio_put(pins->we, false);
-    busy_wait_at_least_cycles(3);
-    gpio_put(pins->we, true);
-    busy_wait_at_least_cycles(3); // at least 5ns until cle deassert and io_val change
-    gpio_put(pins->cle, false);
+    sio_hw->gpio_clr = WE_MASK(pins);
+    busy_wait_at_least_cycles(cycles_glob.we_low);
+    sio_hw->gpio_set = WE_MASK(pins);
+    busy_wait_at_least_cycles(cycles_glob.latch_hold); // until cle deassert and io_val change
+    sio_hw->gpio_clr = CLE_MASK(pins);
+}
+
+bool __time_critical_func(wait_ready)(nand_pins_t* pins, uint32_t timeout_us)
+{
+    busy_wait_at_least_cycles(cycles_glob.wb); // tWB before ready signal goes low
+
+    uint32_t start = time_us_32();
+    while (!gpio_get(pins->ry)) {
+        if (time_us_32() - start > timeout_us) {
+            stats_glob.ry_timeouts++;
+            return false;
+        }
+        busy_wait_at_least_cycles(cycles_glob.wb);
+    }
+    busy_wait_at_least_cycles(cycles_glob.rr);
+    return true;
 }
 
+// Only needed at init and to recover from an error, the read paths poll RY instead
 void reset_nand(nand_pins_t* pins)
 {
     write_cmd(pins, 0xFF);
+    wait_ready(pins, RESET_TIMEOUT_US);
     gpio_put(pins->ce, true);
-    sleep_us(600); // a little more than max time to reset
 }
 
-void write_addr_1(nand_pins_t* pins, uint8_t addr)
+void __time_critical_func(write_addr_cycles)(nand_pins_t* pins, const uint8_t* addr_bytes, int num_cycles)
 {
-    gpio_put(pins->ce, false); // buffer of 5ns
-    gpio_put(pins->re, true);
-    gpio_put(pins->we, true);
-    gpio_put(pins->cle, false);
+    // RE/WE idle high, ALE up, CLE down, CE down
+    sio_hw->gpio_set = RE_MASK(pins) | WE_MASK(pins) | ALE_MASK(pins);
+    sio_hw->gpio_clr = CLE_MASK(pins) | CE_MASK(pins);
     set_io_dir(pins, true);
-    gpio_put(pins->ale, true);
-    busy_wait_at_least_cycles(4);
+    busy_wait_at_least_cycles(cycles_glob.addr_setup);
 
-    set_io_val(pins, addr);
-    busy_wait_at_least_cycles(3);
-    gpio_put(pins->we, false);
-    busy_wait_at_least_cycles(3);
-    gpio_put(pins->we, true);
-    busy_wait_at_least_cycles(3);
-    gpio_put(pins->ale, false);
+    for (int i = 0; i < num_cycles; i++) {
+        set_io_val(pins, addr_bytes[i]);
+        busy_wait_at_least_cycles(cycles_glob.data_setup);
+        sio_hw->gpio_clr = WE_MASK(pins);
+        busy_wait_at_least_cycles(cycles_glob.we_low);
+        sio_hw->gpio_set = WE_MASK(pins);
+        busy_wait_at_least_cycles(cycles_glob.we_high);
+    }
+    busy_wait_at_least_cycles(cycles_glob.latch_hold);
+    sio_hw->gpio_clr = ALE_MASK(pins);
 }
 
-void write_addr_5(nand_pins_t* pins, uint32_t page_addr, uint32_t col_addr)
+void __time_critical_func(write_addr_1)(nand_pins_t* pins, uint8_t addr)
 {
+    write_addr_cycles(pins, &addr, 1);
+}
 
-    const int timing_multiplier = 10;
+// Row (page) address cycles of the chip, set from its flash info. Column
+// addresses are always 2 cycles on the large page x8 parts this supports
+#define COL_ADDR_CYCLES 2
+#define MAX_ROW_ADDR_CYCLES 3
+uint32_t row_addr_cycles_glob = MAX_ROW_ADDR_CYCLES;
 
-    uint8_t col_addr_0 = col_addr & 0xFF;
-    uint8_t col_addr_1 = (col_addr >> 8) & 0x1F;
+// Full column + row address
+void __time_critical_func(write_addr)(nand_pins_t* pins, uint32_t page_addr, uint32_t col_addr)
+{
+    uint8_t addr_bytes[COL_ADDR_CYCLES + MAX_ROW_ADDR_CYCLES] = {
+        col_addr & 0xFF, (col_addr >> 8) & 0xFF,
+        page_addr & 0xFF, (page_addr >> 8) & 0xFF, (page_addr >> 16) & 0xFF
+    };
+    write_addr_cycles(pins, addr_bytes, COL_ADDR_CYCLES + row_addr_cycles_glob);
+}
 
-    uint8_t page_addr_0 = page_addr & 0xFF;
-    uint8_t page_addr_1 = (page_addr >> 8) & 0xFF;
-    uint8_t page_addr_2 = (page_addr >> 16) & 0x01;
+// Row (page) address only, for the multi-plane 0x60 loads
+void __time_critical_func(write_addr_row)(nand_pins_t* pins, uint32_t page_addr)
+{
+    uint8_t addr_bytes[MAX_ROW_ADDR_CYCLES] = { page_addr & 0xFF, (page_addr >> 8) & 0xFF, (page_addr >> 16) & 0xFF };
+    write_addr_cycles(pins, addr_bytes, row_addr_cycles_glob);
+}
 
-    uint8_t addr_bytes[5] = { col_addr_0, col_addr_1, page_addr_0, page_addr_1, page_addr_2 };
+// Column address only, for random data output (0x05/0xE0)
+void __time_critical_func(write_addr_col)(nand_pins_t* pins, uint32_t col_addr)
+{
+    uint8_t addr_bytes[COL_ADDR_CYCLES] = { col_addr & 0xFF, (col_addr >> 8) & 0xFF };
+    write_addr_cycles(pins, addr_bytes, COL_ADDR_CYCLES);
+}
 
-    gpio_put(pins->ce, false); // buffer of 5ns
-    gpio_put(pins->re, true);
-    gpio_put(pins->we, true);
-    gpio_put(pins->cle, false);
+void __time_critical_func(prepare_data_out)(nand_pins_t* pins)
+{
+    set_io_dir(pins, false); // set to input for read
+    sio_hw->gpio_set = WE_MASK(pins) | RE_MASK(pins);
+    sio_hw->gpio_clr = CE_MASK(pins) | CLE_MASK(pins) | ALE_MASK(pins);
+}
+
+void __time_critical_func(clock_out_bytes)(nand_pins_t* pins, uint8_t* dst, uint32_t num_bytes)
+{
+    for (int i = 0; i < num_bytes; i++) {
+        sio_hw->gpio_clr = RE_MASK(pins);
+        busy_wait_at_least_cycles(cycles_glob.re_low); // tREA before data can be read
+        *(dst + i) = get_io_val(pins);
+        sio_hw->gpio_set = RE_MASK(pins);
+        busy_wait_at_least_cycles(cycles_glob.re_high);
+    }
+}
+
+// Read Status (0x70), can be issued while busy. Bit 6 is ready, bit 0 is fail
+uint8_t __time_critical_func(read_status)(nand_pins_t* pins)
+{
+    uint8_t status = 0;
+
+    write_cmd(pins, 0x70);
+    prepare_data_out(pins);
+    busy_wait_at_least_cycles(cycles_glob.whr);
+    clock_out_bytes(pins, &status, 1);
+    return status;
+}
+
+#define NAND_STATUS_FAIL 0x01 // last program/erase failed
+#define NAND_STATUS_FAILC 0x02 // cache program: the one before failed
+#define NAND_STATUS_ARRAY_READY 0x20 // cache program: the array is done too
+#define NAND_STATUS_READY 0x40
+
+// Waits for RY before data output. If RY times out the status register gets the
+// final say (in case RY is slow or not wired), 0x00 returns the chip to data output
+bool __time_critical_func(start_data_out)(nand_pins_t* pins)
+{
+    prepare_data_out(pins);
+
+    if (wait_ready(pins, READY_TIMEOUT_US)) {
+        data_ready_us = time_us_64();
+        return true;
+    }
+    if (!(read_status(pins) & NAND_STATUS_READY)) {
+        return false;
+    }
+    write_cmd(pins, 0x00);
+    prepare_data_out(pins);
+    data_ready_us = time_us_64();
+    return true;
+}
+
+bool __time_critical_func(read_bytes)(nand_pins_t* pins, uint8_t* dst, uint32_t num_bytes)
+{
+    if (!start_data_out(pins)) {
+        return false;
+    }
+    clock_out_bytes(pins, dst, num_bytes);
+    return true;
+}
+
+// Data input cycles of a page program, the chip latches IO0-7 on WE going high
+void __time_critical_func(clock_in_bytes)(nand_pins_t* pins, const uint8_t* src, uint32_t num_bytes)
+{
+    sio_hw->gpio_set = RE_MASK(pins) | WE_MASK(pins);
+    sio_hw->gpio_clr = CE_MASK(pins) | CLE_MASK(pins) | ALE_MASK(pins);
     set_io_dir(pins, true);
-    gpio_put(pins->ale, true);
-    busy_wait_at_least_cycles(5 * timing_multiplier);
 
-    for (int i = 0; i < 5; i++) {
-        set_io_val(pins, addr_bytes[i]);
-        busy_wait_at_least_cycles(4 * timing_multiplier);
-        gpio_put(pins->we, false);
-        busy_wait_at_least_cycles(4 * timing_multiplier);
-        gpio_put(pins->we, true);
-        busy_wait_at_least_cycles(4 * timing_multiplier);
+    for (uint32_t i = 0; i < num_bytes; i++) {
+        set_io_val(pins, src[i]);
+        busy_wait_at_least_cycles(cycles_glob.data_setup);
+        sio_hw->gpio_clr = WE_MASK(pins);
+        busy_wait_at_least_cycles(cycles_glob.we_low);
+        sio_hw->gpio_set = WE_MASK(pins);
+        busy_wait_at_least_cycles(cycles_glob.we_high);
     }
-    busy_wait_at_least_cycles(3 * timing_multiplier);
-    gpio_put(pins->ale, false);
 }
 
-void read_bytes(nand_pins_t* pins, uint8_t* dst, uint32_t num_bytes)
+// tPROG and tBERS are hundreds of us and a few ms, these leave room for worn parts
+const uint32_t PROGRAM_TIMEOUT_US = 3000;
+const uint32_t ERASE_TIMEOUT_US = 15000;
+
+/// Block erase (0x60/0xD0) of the block page_num is in. Returns the status
+/// register, NAND_STATUS_READY set and NAND_STATUS_FAIL clear if it worked
+uint8_t erase_block(nand_pins_t* pins, uint32_t page_num)
+{
+    write_cmd(pins, 0x60);
+    write_addr_row(pins, page_num);
+    write_cmd(pins, 0xD0);
+    wait_ready(pins, ERASE_TIMEOUT_US);
+    return read_status(pins); // the final say if RY is slow or not wired
+}
+
+/// Page program (0x80, data, 0x10). With cache the page is confirmed with 0x15
+/// instead: the chip is ready for the next page's data as soon as this one has
+/// moved on to the array, and the status then reports this page in
+/// NAND_STATUS_FAILC once the next program command is through. The last page
+/// of a run has to use 0x10 (or finish_cache_program()). Returns the status register
+uint8_t __time_critical_func(program_page)(nand_pins_t* pins, uint32_t page_num, const uint8_t* data, uint32_t num_bytes, bool cache)
 {
-    const int timing_multiplier = 2;
+    write_cmd(pins, 0x80);
+    write_addr(pins, page_num, 0); // column address 0
+    busy_wait_at_least_cycles(cycles_glob.adl);
+    clock_in_bytes(pins, data, num_bytes);
+    write_cmd(pins, cache ? 0x15 : 0x10);
+    wait_ready(pins, PROGRAM_TIMEOUT_US);
+    return read_status(pins);
+}
 
-    set_io_dir(pins, false); // set to input for read
-    gpio_put(pins->ce, false);
-    gpio_put(pins->cle, false);
-    gpio_put(pins->ale, false);
-    gpio_put(pins->we, true);
-    gpio_put(pins->re, true);
+/// Waits for the array after a cache program no 0x10 followed, NAND_STATUS_FAIL
+/// is then about that last page. Returns 0 (not ready) if it never finishes
+uint8_t finish_cache_program(nand_pins_t* pins)
+{
+    uint32_t start = time_us_32();
+    do {
+        uint8_t status = read_status(pins);
+        if (status & NAND_STATUS_ARRAY_READY) {
+            return status;
+        }
+    } while (time_us_32() - start < PROGRAM_TIMEOUT_US);
+    return 0;
+}
 
-    busy_wait_at_least_cycles(20 * timing_multiplier); // 100ns max before ready signal goes low
+void init_nand_pio(nand_pins_t* pins)
+{
+    nand_read_sm = pio_claim_unused_sm(nand_pio, true);
+    uint offset = pio_add_program(nand_pio, &nand_read_program);
+    nand_read_program_init(nand_pio, nand_read_sm, offset, pins->io_start, pins->re, 1.0f); // apply_timing() sets the real divider
 
-    while (!gpio_get(pins->ry)) {
-        busy_wait_at_least_cycles(20 * timing_multiplier);
+    nand_dma_chan = dma_claim_unused_channel(true);
+
+    nand_capture_sm = pio_claim_unused_sm(nand_pio, true);
+    offset = pio_add_program(nand_pio, &nand_capture_program);
+    nand_capture_program_init(nand_pio, nand_capture_sm, offset, 1.0f);
+    capture_dma_chan = dma_claim_unused_channel(true);
+}
+
+// Recomputes every bus delay (and the nand_read clock divider) for the current
+// clk_sys. Only call while the bus is idle, i.e. from core1 or before it starts
+void apply_timing(const nand_timing_t* timing, uint32_t scale_pct)
+{
+    timing_glob = timing;
+    timing_scale_pct = scale_pct;
+    compute_cycles(timing, scale_pct, clock_get_hz(clk_sys), &cycles_glob);
+    pio_sm_set_clkdiv(nand_pio, nand_read_sm, cycles_glob.pio_clkdiv);
+}
+
+uint32_t __scratch_x("nand") crc32_table[256] = { 0 };
+
+void init_crc32_table()
+{
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int j = 0; j < 8; j++) {
+            crc = (crc & 1) ? (crc >> 1) ^ 0xEDB88320 : crc >> 1;
+        }
+        crc32_table[i] = crc;
+    }
+}
+
+uint32_t crc32(const uint8_t* data, uint32_t len)
+{
+    uint32_t crc = 0xFFFFFFFF;
+    for (uint32_t i = 0; i < len; i++) {
+        crc = crc32_table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+/// Bit-banged page reads specialised per page geometry. clock_out_bytes() plus
+/// crc32() go through pins and cycles_glob for every byte. The kernels load the
+/// RE mask and delays once, run a fixed trip count unrolled four bytes at a time
+/// and fold the CRC32 into the strobe loop. They live in RAM so an XIP cache miss
+/// can't stretch an RE pulse. select_page_kernel() picks one after get_flash_info()
+typedef void (*page_kernel_t)(nand_pins_t* pins, uint8_t* dst, uint32_t* crc);
+
+#define PAGE_KERNEL_BYTE(dst_byte)                       \
+    do {                                                 \
+        sio_hw->gpio_clr = re_mask;                      \
+        busy_wait_at_least_cycles(re_low);               \
+        uint8_t val = sio_hw->gpio_in & 0xFF;            \
+        sio_hw->gpio_set = re_mask;                      \
+        (dst_byte) = val;                                \
+        crc = crc32_table[(crc ^ val) & 0xFF] ^ (crc >> 8); \
+        busy_wait_at_least_cycles(re_high);              \
+    } while (0)
+
+#define DEFINE_PAGE_KERNEL(name, page_bytes)                                    \
+    static_assert((page_bytes) % 4 == 0, "page kernels are unrolled by 4");     \
+    void __not_in_flash_func(name)(nand_pins_t * pins, uint8_t * dst, uint32_t * crc_out) \
+    {                                                                           \
+        const uint32_t re_mask = RE_MASK(pins);                                 \
+        const uint32_t re_low = cycles_glob.re_low;                             \
+        const uint32_t re_high = cycles_glob.re_high;                           \
+        uint32_t crc = 0xFFFFFFFF;                                              \
+        for (uint32_t i = 0; i < (page_bytes); i += 4) {                        \
+            PAGE_KERNEL_BYTE(dst[i]);                                           \
+            PAGE_KERNEL_BYTE(dst[i + 1]);                                       \
+            PAGE_KERNEL_BYTE(dst[i + 2]);                                       \
+            PAGE_KERNEL_BYTE(dst[i + 3]);                                       \
+        }                                                                       \
+        *crc_out = ~crc;                                                        \
     }
-    busy_wait_at_least_cycles(5 * timing_multiplier);
 
-    for (int i = 0; i < num_bytes; i++) {
-        gpio_put(pins->re, false);
-        busy_wait_at_least_cycles(5 * timing_multiplier); // 20ns required before data can be read
-        *(dst + i) = get_io_val(pins);
-        busy_wait_at_least_cycles(3 * timing_multiplier);
-        gpio_put(pins->re, true);
-        busy_wait_at_least_cycles(3 * timing_multiplier);
+DEFINE_PAGE_KERNEL(read_page_kernel_2k, 2048 + 128)
+DEFINE_PAGE_KERNEL(read_page_kernel_4k, 4096 + 256)
+
+typedef struct {
+    uint32_t page_bytes; // page + oob
+    page_kernel_t kernel;
+} page_kernel_entry_t;
+
+const page_kernel_entry_t PAGE_KERNELS[] = {
+    { 2048 + 128, read_page_kernel_2k },
+    { 4096 + 256, read_page_kernel_4k },
+};
+
+// Kernel for the current chip's page + oob size, NULL if there is none and
+// clock_out_bytes() is used
+page_kernel_t page_kernel_glob = NULL;
+uint32_t page_kernel_bytes = 0;
+
+void select_page_kernel(uint32_t page_bytes)
+{
+    page_kernel_glob = NULL;
+    page_kernel_bytes = 0;
+    for (int i = 0; i < sizeof(PAGE_KERNELS) / sizeof(PAGE_KERNELS[0]); i++) {
+        if (PAGE_KERNELS[i].page_bytes == page_bytes) {
+            page_kernel_glob = PAGE_KERNELS[i].kernel;
+            page_kernel_bytes = page_bytes;
+        }
+    }
+}
+
+// Same as read_bytes(), but the RE strobes come from the nand_read state machine
+// and the RX FIFO is moved into dst by DMA. num_bytes must be a multiple of 4
+// and dst word aligned. The DMA sniffer computes the CRC32 of the data (same
+// as crc32()) on the way, so it costs no CPU time
+bool __time_critical_func(read_bytes_pio)(nand_pins_t* pins, uint8_t* dst, uint32_t num_bytes, uint32_t* crc)
+{
+    if (!start_data_out(pins)) {
+        return false;
+    }
+
+    dma_channel_config c = dma_channel_get_default_config(nand_dma_chan);
+    channel_config_set_transfer_data_size(&c, DMA_SIZE_32);
+    channel_config_set_read_increment(&c, false);
+    channel_config_set_write_increment(&c, true);
+    channel_config_set_dreq(&c, pio_get_dreq(nand_pio, nand_read_sm, false));
+    channel_config_set_sniff_enable(&c, true);
+
+    // bit reversed CRC32 over each little endian word is the byte stream's zlib CRC32
+    dma_sniffer_enable(nand_dma_chan, DMA_SNIFF_CTRL_CALC_VALUE_CRC32R, true);
+    dma_sniffer_set_output_reverse_enabled(true);
+    dma_sniffer_set_output_invert_enabled(true);
+    dma_sniffer_set_data_accumulator(0xFFFFFFFF);
+    dma_channel_configure(nand_dma_chan, &c, dst, &nand_pio->rxf[nand_read_sm], num_bytes / 4, true);
+
+    // RE is driven by the SM only for the duration of the transfer
+    gpio_set_function(pins->re, GPIO_FUNC_PIO0);
+    pio_sm_put_blocking(nand_pio, nand_read_sm, num_bytes - 1);
+    dma_channel_wait_for_finish_blocking(nand_dma_chan);
+    gpio_set_function(pins->re, GPIO_FUNC_SIO);
+    *crc = dma_sniffer_get_data_accumulator();
+    dma_sniffer_disable();
+    return true;
+}
+
+// crc gets the CRC32 of the data, from the DMA sniffer when reading through PIO
+bool __time_critical_func(read_data)(nand_pins_t* pins, uint8_t* dst, uint32_t num_bytes, uint32_t* crc)
+{
+    bool pio_ok = (num_bytes % 4) == 0 && ((uintptr_t)dst % 4) == 0;
+
+    if (read_mode_glob == READ_MODE_PIO && pio_ok) {
+        return read_bytes_pio(pins, dst, num_bytes, crc);
+    }
+    // fallback, also used for odd sizes like the ID bytes
+    if (page_kernel_glob && num_bytes == page_kernel_bytes) {
+        if (!start_data_out(pins)) {
+            return false;
+        }
+        page_kernel_glob(pins, dst, crc);
+        return true;
+    }
+    if (!read_bytes(pins, dst, num_bytes)) {
+        return false;
     }
+    *crc = crc32(dst, num_bytes);
+    return true;
 }
 
 /*
@@ -326,11 +975,11 @@ ID[4] = 76 2 districts
 
 */
 
-void read_id(nand_pins_t* pins, id_data_t* id_bytes)
+bool read_id(nand_pins_t* pins, id_data_t* id_bytes)
 {
     write_cmd(pins, 0x90);
     write_addr_1(pins, 0x00);
-    read_bytes(pins, (unsigned char*)id_bytes, sizeof(id_data_t));
+    return read_bytes(pins, (unsigned char*)id_bytes, sizeof(id_data_t));
 }
 
 typedef enum maker_enum {
@@ -357,43 +1006,145 @@ void explain_id(id_data_t* id_bytes)
     printf("Block Size: %d KB\n", (1 << ((id_bytes->pgsz_bksz_iow & 0x30) >> 4)) * 64);
     printf("I/O Width: x%d\n", (1 << ((id_bytes->pgsz_bksz_iow & 0x40) >> 6)) * 8);
 
-    printf("Number of Districts: %d\n", (1 << ((id_bytes->pgsz_bksz_iow & 0x0B) >> 6) + 1));
+    printf("Number of Districts: %d\n", 1 << ((id_bytes->districts >> 2) & 0x03));
 }
 
 typedef struct _pg_sz_struct {
     uint16_t page_size_bytes;
     uint16_t oob_size_bytes;
+    uint16_t pages_per_block;
+    uint32_t num_blocks;
+    uint8_t num_planes; // districts for the Toshiba 0x60/0x60/0x30 reads, blocks alternate between them
+    uint8_t row_addr_cycles;
+    bool cache_read; // supports read cache sequential (0x31/0x3F)
+    bool cache_program; // supports cache program (0x80/0x15)
     uint64_t flash_size_bytes;
+    const nand_timing_t* timing;
 } flash_info_struct;
 
-bool get_flash_info(id_data_t* id_bytes, flash_info_struct* flash_info)
+/// Known parts. Anything not in here is asked for its ONFI parameter page, and
+/// failing that decoded from the extended ID bytes
+typedef struct {
+    uint8_t maker;
+    uint8_t device;
+    flash_info_struct info; // flash_size_bytes is filled in from the rest
+} chip_info_t;
+
+const chip_info_t CHIP_TABLE[] = {
+    { TOSHIBA_KIOXIA, 0xDC, { 4096, 256, 64, 2048, 2, 3, true, true, 0, &TIMING_TOSHIBA_TC58 } }, // TC58NVG2S0H
+    { TOSHIBA_KIOXIA, 0xDA, { 2048, 128, 64, 2048, 2, 3, true, true, 0, &TIMING_TOSHIBA_TC58 } }, // TC58NVG1S3H
+};
+
+bool lookup_chip(id_data_t* id_bytes, flash_info_struct* flash_info)
 {
+    for (int i = 0; i < count_of(CHIP_TABLE); i++) {
+        if (CHIP_TABLE[i].maker == id_bytes->maker && CHIP_TABLE[i].device == id_bytes->device) {
+            *flash_info = CHIP_TABLE[i].info;
+            return true;
+        }
+    }
+    return false;
+}
 
-    uint32_t pg_size_kb = (1 << (id_bytes->pgsz_bksz_iow & 0x03));
+/// ONFI parameter page (0xEC). 256 bytes, repeated at least three times, each copy
+/// ending in a CRC-16 so a mangled one can be skipped
+#define ONFI_PARAM_PAGE_SIZE 256
+#define ONFI_PARAM_PAGE_COPIES 3
 
-    if (id_bytes->maker == TOSHIBA_KIOXIA) {
-        switch (pg_size_kb) {
-        case 4:
-            flash_info->page_size_bytes = 4096;
-            flash_info->oob_size_bytes = 256;
-            break;
-        case 2:
-            flash_info->page_size_bytes = 2048;
-            flash_info->oob_size_bytes = 128; // TODO: is this just the formula page_size / 16?
-            break;
-        default:
-            // printf("bad pg_size_kb = %d\n", pg_size_kb);
-            return false;
+uint16_t onfi_crc16(const uint8_t* data, uint32_t len)
+{
+    uint16_t crc = 0x4F4E;
+    for (uint32_t i = 0; i < len; i++) {
+        crc ^= (uint16_t)data[i] << 8;
+        for (int j = 0; j < 8; j++) {
+            crc = (crc & 0x8000) ? (crc << 1) ^ 0x8005 : crc << 1;
         }
+    }
+    return crc;
+}
+
+uint32_t le16(const uint8_t* p)
+{
+    return p[0] | (p[1] << 8);
+}
 
-        // So far, this is tracks, but it may not apply to all Toshiba chips
-        uint32_t total_pg_size = (uint32_t)flash_info->page_size_bytes + (uint32_t)flash_info->oob_size_bytes;
-        flash_info->flash_size_bytes = 64 * 2048 * total_pg_size;
+uint32_t le32(const uint8_t* p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
 
-        return true;
+bool read_onfi_params(nand_pins_t* pins, flash_info_struct* flash_info)
+{
+    uint8_t param[ONFI_PARAM_PAGE_SIZE];
+
+    write_cmd(pins, 0xEC);
+    write_addr_1(pins, 0x00);
+    if (!start_data_out(pins)) {
+        return false;
     }
-    // printf("unknown maker = %x\n", id_bytes->maker);
-    return false;
+
+    bool valid = false;
+    for (int copy = 0; copy < ONFI_PARAM_PAGE_COPIES && !valid; copy++) {
+        clock_out_bytes(pins, param, sizeof(param)); // copies follow each other
+        valid = memcmp(param, "ONFI", 4) == 0 && onfi_crc16(param, 254) == le16(&param[254]);
+    }
+    gpio_put(pins->ce, true);
+    if (!valid || (le16(&param[6]) & 0x01)) { // bit 0 of the features is a x16 bus
+        return false;
+    }
+
+    uint32_t timing_modes = le16(&param[129]);
+    int mode = 0;
+    for (int i = 0; i < NUM_ONFI_TIMING_MODES; i++) {
+        if (timing_modes & (1u << i)) {
+            mode = i;
+        }
+    }
+
+    flash_info->page_size_bytes = le32(&param[80]);
+    flash_info->oob_size_bytes = le16(&param[84]);
+    flash_info->pages_per_block = le32(&param[92]);
+    flash_info->num_blocks = le32(&param[96]) * param[100]; // blocks per LUN * LUNs
+    flash_info->num_planes = 1; // ONFI multi-plane reads use a different command set
+    flash_info->row_addr_cycles = param[101] & 0x0F;
+    flash_info->cache_read = le16(&param[8]) & 0x02;
+    flash_info->cache_program = le16(&param[8]) & 0x01;
+    flash_info->timing = &TIMING_ONFI_MODES[mode];
+    return flash_info->row_addr_cycles <= MAX_ROW_ADDR_CYCLES && (param[101] >> 4) == COL_ADDR_CYCLES;
+}
+
+// Last resort for Toshiba parts: page and block size from the extended ID, the
+// block count isn't in there so assume 2048
+bool decode_id_info(id_data_t* id_bytes, flash_info_struct* flash_info)
+{
+    uint32_t pg_size_kb = (1 << (id_bytes->pgsz_bksz_iow & 0x03));
+
+    if (id_bytes->maker != TOSHIBA_KIOXIA || (pg_size_kb != 2 && pg_size_kb != 4)) {
+        return false;
+    }
+
+    uint32_t blk_size_kb = (1 << ((id_bytes->pgsz_bksz_iow & 0x30) >> 4)) * 64;
+    flash_info->page_size_bytes = pg_size_kb * 1024;
+    flash_info->oob_size_bytes = pg_size_kb * 64;
+    flash_info->pages_per_block = blk_size_kb / pg_size_kb;
+    flash_info->num_blocks = 2048;
+    flash_info->num_planes = 1 << ((id_bytes->districts >> 2) & 0x03);
+    flash_info->row_addr_cycles = 3;
+    flash_info->cache_read = false;
+    flash_info->cache_program = false;
+    flash_info->timing = &TIMING_ONFI_MODES[0];
+    return true;
+}
+
+bool get_flash_info(nand_pins_t* pins, id_data_t* id_bytes, flash_info_struct* flash_info)
+{
+    if (!lookup_chip(id_bytes, flash_info) && !read_onfi_params(pins, flash_info) && !decode_id_info(id_bytes, flash_info)) {
+        return false;
+    }
+
+    uint32_t total_pg_size = (uint32_t)flash_info->page_size_bytes + (uint32_t)flash_info->oob_size_bytes;
+    flash_info->flash_size_bytes = (uint64_t)flash_info->num_blocks * flash_info->pages_per_block * total_pg_size;
+    return true;
 }
 
 bool check_supported_io_width(id_data_t* id_bytes)
@@ -403,77 +1154,1819 @@ bool check_supported_io_width(id_data_t* id_bytes)
     return io_width == 8; // currently this dumper only supports x8 chips
 }
 
-void read_page(nand_pins_t* pins, uint32_t page_num, uint8_t* page_buff, uint32_t page_size)
+// Starts loading a page into the data register (tR), the chip goes busy afterwards
+void __time_critical_func(issue_page_read)(nand_pins_t* pins, uint32_t page_num)
 {
-    reset_nand(pins);
     write_cmd(pins, 0x00);
-    write_addr_5(pins, page_num, 0); // column address 0
+    write_addr(pins, page_num, 0); // column address 0
     write_cmd(pins, 0x30);
-    sleep_us(1);
-    read_bytes(pins, page_buff, page_size);
 }
 
-void display_page(uint8_t* page_buff, uint32_t page_size)
+// No reset per page, the chip is reset once at init and after a timeout
+bool __time_critical_func(read_page)(nand_pins_t* pins, uint32_t page_num, uint8_t* page_buff, uint32_t page_size, uint32_t* crc)
 {
-    for (int i = 0; i < page_size; i++) {
-        printf("%02X", page_buff[i]);
+    uint64_t start = time_us_64();
+    issue_page_read(pins, page_num);
+    uint64_t issued = time_us_64();
+
+    if (!read_data(pins, page_buff, page_size, crc)) { // waits out tR first
+        return false;
     }
+    stats_record_page(issued - start, 0, issued);
+    return true;
 }
 
-// Shared State between cores
-queue_t cmd_queue = { 0 };
-queue_t results_queue = { 0 };
-nand_pins_t pins_glob = { 0 };
-uint8_t shared_buffer[16384] = { 0 };
-flash_info_struct flash_info_glob = { 0 };
+/// Read cache sequential (Toshiba 0x31/0x3F). The first page of a run is loaded
+/// with the normal 0x00/addr/0x30 sequence, after that every 0x31 moves the page in
+/// the data register to the cache register and starts loading the next page into
+/// the data register while the cache register is clocked out. 0x3F ends the run
+/// without starting another load.
+///
+/// Runs must not cross a block and any other bus command has to be preceded by
+/// end_cache_read().
+typedef struct {
+    bool active; // a 0x31 has been issued and the chip is expecting more
+    uint32_t next_page; // page the next 0x31/0x3F will deliver
+} cache_read_state_t;
 
-void core1_main()
+bool __time_critical_func(read_page_cached)(nand_pins_t* pins, cache_read_state_t* state, uint32_t page_num, uint8_t* page_buff, uint32_t page_size, bool last, uint32_t* crc)
 {
+    uint32_t setup_us = 0;
+    uint32_t tr_us = 0;
 
-    cmd_t cmd_arg = { 0, 5 };
-    result_t result = { 0 };
-    int page_num = 0;
+    if (!state->active || state->next_page != page_num) {
+        if (state->active) {
+            reset_nand(pins); // not the page the chip has lined up, start over
+        }
+        uint64_t start = time_us_64();
+        issue_page_read(pins, page_num);
+        uint64_t issued = time_us_64();
+        if (!wait_ready(pins, READY_TIMEOUT_US)) { // tR
+            state->active = false;
+            return false;
+        }
+        setup_us = issued - start;
+        tr_us = time_us_64() - issued;
+    }
 
-    while (1) {
+    uint64_t start = time_us_64();
+    write_cmd(pins, last ? 0x3F : 0x31);
+    uint64_t issued = time_us_64();
+    state->active = !last;
+    state->next_page = page_num + 1;
 
-        queue_remove_blocking(&cmd_queue, &cmd_arg);
+    if (!read_data(pins, page_buff, page_size, crc)) { // waits out tDCBSYR first
+        state->active = false;
+        return false;
+    }
+    stats_record_page(setup_us + (issued - start), tr_us, issued);
+    return true;
+}
 
-        switch (cmd_arg.cmd) {
-        case CMD_READ_ID:
-            result.sz = sizeof(id_data_t);
-            read_id(&pins_glob, (id_data_t*)shared_buffer);
-            break;
+/// Two plane read (Toshiba 0x60/0x60/0x30). The two pages have to be the same page
+/// of an even block and of the odd block after it (one per district). Both load
+/// in a single tR, then each is selected for output in turn with 0x00/addr/0x05/col/0xE0
+bool __time_critical_func(read_pages_multiplane)(nand_pins_t* pins, const uint32_t* page_nums, uint8_t** page_buffs, uint32_t page_size, uint32_t* crcs)
+{
+    uint64_t start = time_us_64();
+    write_cmd(pins, 0x60);
+    write_addr_row(pins, page_nums[0]);
+    write_cmd(pins, 0x60);
+    write_addr_row(pins, page_nums[1]);
+    write_cmd(pins, 0x30);
+    uint64_t issued = time_us_64();
 
-        case CMD_READ_PAGE:
-            result.sz = flash_info_glob.page_size_bytes + flash_info_glob.oob_size_bytes; // TODO adjust this for other page sizes
-            memset(shared_buffer, 0, sizeof(shared_buffer));
-            read_page(&pins_glob, page_num, shared_buffer, result.sz);
-            page_num += 1;
-            break;
+    if (!wait_ready(pins, READY_TIMEOUT_US)) { // tR, for both pages
+        return false;
+    }
+    uint32_t setup_us = issued - start;
+    uint32_t tr_us = time_us_64() - issued;
+
+    for (int i = 0; i < 2; i++) {
+        uint64_t out_start = time_us_64();
+        write_cmd(pins, 0x00);
+        write_addr(pins, page_nums[i], 0);
+        write_cmd(pins, 0x05);
+        write_addr_col(pins, 0);
+        write_cmd(pins, 0xE0);
+        busy_wait_at_least_cycles(cycles_glob.whr);
+        uint64_t out_issued = time_us_64();
+
+        if (!read_data(pins, page_buffs[i], page_size, &crcs[i])) {
+            return false;
+        }
+        // the shared tR is booked on the first page
+        stats_record_page(setup_us + (out_issued - out_start), tr_us, out_issued);
+        setup_us = 0;
+        tr_us = 0;
+    }
+    return true;
+}
 
-        case CMD_RESET_PAGE_NO:
-            result.sz = 1; // TODO make a proper return value
-            result.alloc = 0;
-            page_num = 0;
+void end_cache_read(nand_pins_t* pins, cache_read_state_t* state)
+{
+    if (state->active) {
+        reset_nand(pins);
+        state->active = false;
+    }
+}
 
-            break;
+/// Factory bad block markers. A block is bad when the first spare byte of its
+/// first or second page isn't 0xFF. The markers are read once into a bitmap, so
+/// a dump can skip bad blocks without going near the bus. Every chip has its own
+#define MAX_BLOCKS 8192
+uint32_t bad_block_map[MAX_CHIPS][MAX_BLOCKS / 32] = { 0 };
+uint32_t bbt_num_blocks = 0; // blocks covered by bad_block_map, 0 until a scan has run
 
-        case CMD_SET_PAGE_NO:
+bool read_bad_block_marker(nand_pins_t* pins, uint32_t page_num, uint32_t page_size, uint8_t* marker)
+{
+    write_cmd(pins, 0x00);
+    write_addr(pins, page_num, page_size); // column address of the first spare byte
+    write_cmd(pins, 0x30);
+    return read_bytes(pins, marker, 1);
+}
+
+// Scans every chip, returns the number of bad blocks found on all of them. Leaves chip 0 selected
+uint32_t scan_bad_blocks(nand_pins_t* pins, uint32_t num_blocks, uint32_t pages_per_block, uint32_t page_size)
+{
+    uint32_t num_bad = 0;
+
+    num_blocks = MIN(num_blocks, MAX_BLOCKS);
+    memset(bad_block_map, 0, sizeof(bad_block_map));
+
+    for (int c = 0; c < pins->num_chips; c++) {
+        select_chip(pins, c);
+        for (uint32_t block = 0; block < num_blocks; block++) {
+            bool bad = false;
+            for (uint32_t i = 0; i < 2 && !bad; i++) {
+                uint8_t marker = 0xFF;
+                if (!read_bad_block_marker(pins, block * pages_per_block + i, page_size, &marker)) {
+                    reset_nand(pins);
+                    bad = true; // can't even read the marker, don't trust the block
+                } else {
+                    bad = marker != 0xFF;
+                }
+            }
+            if (bad) {
+                bad_block_map[c][block / 32] |= 1u << (block % 32);
+                num_bad++;
+            }
+        }
+    }
+    select_chip(pins, 0);
+    bbt_num_blocks = num_blocks;
+    return num_bad;
+}
+
+bool is_block_bad(int chip, uint32_t block)
+{
+    return block < bbt_num_blocks && (bad_block_map[chip][block / 32] >> (block % 32)) & 1;
+}
+
+/// Majority vote re-read for pages that don't read back the same every time.
+/// The page is read votes times and every bit keeps a count of how often it came
+/// back as 1. The counts are bit sliced: plane p holds bit p of the count of all
+/// 32 bits of a word, so adding a read is a ripple carry over VOTE_PLANES words
+/// and no bit is ever handled on its own
+#define VOTE_PLANES 4
+#define MAX_VOTES ((1 << VOTE_PLANES) - 1)
+
+// planes are VOTE_PLANES page sized scratch buffers and page_size a multiple
+// of 4. buf gets the voted page, returns false if any of the reads fails
+bool vote_page(nand_pins_t* pins, uint32_t page_num, uint8_t* buf, uint32_t page_size, uint32_t votes, uint32_t** planes, uint32_t* unstable_bits)
+{
+    uint32_t* words = (uint32_t*)buf;
+    uint32_t num_words = page_size / 4;
+    uint32_t crc;
+
+    for (int p = 0; p < VOTE_PLANES; p++) {
+        memset(planes[p], 0, page_size);
+    }
+
+    for (uint32_t v = 0; v < votes; v++) {
+        if (!read_page(pins, page_num, buf, page_size, &crc)) {
+            return false;
+        }
+        for (uint32_t i = 0; i < num_words; i++) {
+            uint32_t carry = words[i];
+            for (int p = 0; p < VOTE_PLANES && carry; p++) {
+                uint32_t next = planes[p][i] & carry;
+                planes[p][i] ^= carry;
+                carry = next;
+            }
+        }
+    }
+
+    // a bit votes 1 when its count >= threshold and is unstable unless the count is 0 or votes
+    uint32_t threshold = votes / 2 + 1;
+    *unstable_bits = 0;
+    for (uint32_t i = 0; i < num_words; i++) {
+        uint32_t gt = 0; // count > threshold so far, going from the top plane down
+        uint32_t eq = ~0u; // count == threshold so far
+        uint32_t all = ~0u; // count == votes so far
+        uint32_t any = 0; // count != 0
+        for (int p = VOTE_PLANES - 1; p >= 0; p--) {
+            uint32_t c = planes[p][i];
+            if ((threshold >> p) & 1) {
+                eq &= c;
+            } else {
+                gt |= eq & c;
+                eq &= ~c;
+            }
+            all &= ((votes >> p) & 1) ? c : ~c;
+            any |= c;
+        }
+        words[i] = gt | eq;
+        *unstable_bits += __builtin_popcount(any & ~all);
+    }
+    return true;
+}
+
+void display_page(uint8_t* page_buff, uint32_t page_size)
+{
+    for (int i = 0; i < page_size; i++) {
+        printf("%02X", page_buff[i]);
+    }
+}
+
+/// Binary stream used by CMD_DUMP_PAGES. Every frame is a frame_hdr_t followed
+/// by len bytes of payload, all little endian:
+///   FRAME_PAGE  - payload is the raw page (data + oob), crc is its CRC32
+///   FRAME_ERROR - page could not be read, no payload
+///   FRAME_END   - last frame of a dump, page is one past the last page sent
+///   FRAME_BBT   - answer to CMD_SCAN_BAD_BLOCKS, page is the number of blocks and
+///                 the payload a bitmap of the bad ones (bit n%8 of byte n/8)
+///   FRAME_BAD_BLOCK - page is in a bad block and was skipped, no payload
+///   FRAME_ERASED - page is all 0xFF, no payload
+///   FRAME_PAGE_RLE - payload is the page with its 0xFF runs compressed, see rle_encode()
+///   FRAME_VOTE  - answer to CMD_VOTE_PAGE, payload is a u32 count of unstable bits
+///                 followed by the voted page, crc is that of the page alone
+///   FRAME_ECC   - follows a page that had bit flips with DUMP_OPT_ECC, payload is one
+///                 byte per sector, the bits flipped or 0xFF if uncorrectable (see
+///                 ecc_check_page()). Pages without one were clean
+///   FRAME_CAPTURE - answer to CMD_CAPTURE, page is the page that was read and the
+///                 payload a capture_hdr_t followed by the samples
+///   FRAME_HASH  - DUMP_OPT_HASH, page is the number of entries and the payload that
+///                 many (u32 page, u32 CRC32 of the page) pairs. Pages that couldn't
+///                 be read get the usual FRAME_ERROR/FRAME_BAD_BLOCK instead
+/// With DUMP_OPT_STRIPE bits 24-31 of page are the chip the page came from
+#define FRAME_CHIP_SHIFT 24
+/// For FRAME_ERASED and FRAME_PAGE_RLE crc is still that of the full page
+#define FRAME_MAGIC 0xA5
+
+typedef enum frame_type_enum {
+    FRAME_PAGE = 0,
+    FRAME_ERROR = 1,
+    FRAME_END = 2,
+    FRAME_BBT = 3,
+    FRAME_BAD_BLOCK = 4,
+    FRAME_ERASED = 5,
+    FRAME_PAGE_RLE = 6,
+    FRAME_VOTE = 7,
+    FRAME_ECC = 8,
+    FRAME_HASH = 9,
+    FRAME_CAPTURE = 10,
+} frame_type_t;
+
+typedef struct __attribute__((packed)) {
+    uint8_t magic;
+    uint8_t type;
+    uint16_t len;
+    uint32_t page;
+    uint32_t crc; // CRC32 (same as zlib.crc32) of the page data
+} frame_hdr_t;
+
+/// Every buffer a large payload is sent from keeps FRAME_HDR_SPACE bytes free in
+/// front of it. send_frame_crc() builds the header there, so a frame goes out as
+/// one write instead of a short packet for the header. FRAME_VOTE also puts its
+/// count there. Smaller payloads are copied next to their header instead
+#define FRAME_HDR_SPACE 16
+#define FRAME_COPY_MAX 1024
+static_assert(FRAME_HDR_SPACE >= sizeof(frame_hdr_t) + sizeof(uint32_t), "no room for the FRAME_VOTE header");
+uint8_t frame_copy_buffer[FRAME_HDR_SPACE + FRAME_COPY_MAX] __attribute__((aligned(4)));
+
+#define USB_PACKET_SIZE 64 // full speed bulk endpoint
+const uint32_t USB_WRITE_TIMEOUT_US = 500000;
+const uint32_t USB_READ_TIMEOUT_US = 2000000;
+
+// Frames go through stdio_usb's own driver calls rather than printf/putchar: no
+// CRLF translation and no per-character overhead, but still under stdio_usb's
+// mutex, so its background tud_task() never runs in the middle of a FIFO access.
+// out_chars() drops whatever doesn't fit once its own timeout runs out, so it is
+// only ever handed what the FIFO has room for right now, in whole packets but
+// for the tail. Returns false if the host stops reading
+bool stream_write(const uint8_t* data, uint32_t len)
+{
+    uint32_t last_progress = time_us_32();
+
+    while (len > 0) {
+        uint32_t chunk = MIN(len, tud_cdc_write_available());
+        if (chunk < len) {
+            chunk -= chunk % USB_PACKET_SIZE;
+        }
+
+        if (chunk == 0) {
+            if (!stdio_usb_connected() || time_us_32() - last_progress > USB_WRITE_TIMEOUT_US) {
+                return false;
+            }
+            tight_loop_contents();
+            continue;
+        }
+
+        stdio_usb.out_chars((const char*)data, chunk);
+        data += chunk;
+        len -= chunk;
+        last_progress = time_us_32();
+    }
+    return true;
+}
+
+// The other direction, for page data from the host (CMD_PROGRAM), through the
+// same driver. Returns false if the host stops sending
+bool stream_read(uint8_t* data, uint32_t len)
+{
+    uint32_t last_progress = time_us_32();
+
+    while (len > 0) {
+        int chunk = stdio_usb.in_chars((char*)data, len);
+        if (chunk <= 0) {
+            if (!stdio_usb_connected() || time_us_32() - last_progress > USB_READ_TIMEOUT_US) {
+                return false;
+            }
+            tight_loop_contents();
+            continue;
+        }
+        data += chunk;
+        len -= chunk;
+        last_progress = time_us_32();
+    }
+    return true;
+}
+
+// out_chars() flushes after every write already, this only makes sure anything
+// printed through stdio has gone out too
+void stream_flush()
+{
+    stdio_flush();
+}
+
+// data needs FRAME_HDR_SPACE bytes of room in front unless len <= FRAME_COPY_MAX
+bool send_frame_crc(frame_type_t type, uint32_t page, uint8_t* data, uint16_t len, uint32_t crc)
+{
+    frame_hdr_t hdr = {
+        .magic = FRAME_MAGIC,
+        .type = type,
+        .len = len,
+        .page = page,
+        .crc = crc,
+    };
+
+    if (len <= FRAME_COPY_MAX) {
+        if (len) {
+            memcpy(frame_copy_buffer + FRAME_HDR_SPACE, data, len);
+        }
+        data = frame_copy_buffer + FRAME_HDR_SPACE;
+    }
+
+    uint8_t* frame = data - sizeof(hdr);
+    memcpy(frame, &hdr, sizeof(hdr));
+    return stream_write(frame, sizeof(hdr) + len);
+}
+
+bool send_frame(frame_type_t type, uint32_t page, uint8_t* data, uint16_t len)
+{
+    return send_frame_crc(type, page, data, len, len ? crc32(data, len) : 0);
+}
+
+// data is a pool buffer, the header and the count go in the room in front of it
+bool send_vote_frame(uint32_t page, uint8_t* data, uint16_t len, uint32_t unstable_bits)
+{
+    frame_hdr_t hdr = {
+        .magic = FRAME_MAGIC,
+        .type = FRAME_VOTE,
+        .len = len + sizeof(unstable_bits),
+        .page = page,
+        .crc = crc32(data, len),
+    };
+
+    uint8_t* frame = data - sizeof(unstable_bits) - sizeof(hdr);
+    memcpy(frame, &hdr, sizeof(hdr));
+    memcpy(frame + sizeof(hdr), &unstable_bits, sizeof(unstable_bits));
+    return stream_write(frame, sizeof(hdr) + sizeof(unstable_bits) + len);
+}
+
+/// Erased pages. Checked a word at a time, so data must be word aligned (true for
+/// everything in page_buffers) and odd sized pages never count as erased
+bool is_erased(const uint8_t* data, uint32_t len)
+{
+    const uint32_t* words = (const uint32_t*)data;
+    if (len % 4) {
+        return false;
+    }
+    for (uint32_t i = 0; i < len / 4; i++) {
+        if (words[i] != 0xFFFFFFFF) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// CRC32 of an all 0xFF page, only recomputed when the page size changes
+uint32_t erased_crc(uint32_t len)
+{
+    static uint32_t crc_len = 0;
+    static uint32_t crc = 0;
+
+    if (len != crc_len) {
+        crc = 0xFFFFFFFF;
+        for (uint32_t i = 0; i < len; i++) {
+            crc = crc32_table[(crc ^ 0xFF) & 0xFF] ^ (crc >> 8);
+        }
+        crc = ~crc;
+        crc_len = len;
+    }
+    return crc;
+}
+
+/// 0xFF run length encoding for FRAME_PAGE_RLE. The payload is a sequence of
+///   u16 literal length, literal bytes, u16 length of the 0xFF run that follows
+/// (lengths in bytes, little endian) until the page is complete. Runs are found
+/// a word at a time and only runs of at least RLE_MIN_RUN_WORDS are encoded.
+/// Returns the encoded length, or 0 if it wouldn't fit in dst_max bytes
+#define RLE_MIN_RUN_WORDS 4
+
+uint32_t rle_encode(const uint8_t* src, uint32_t len, uint8_t* dst, uint32_t dst_max)
+{
+    const uint32_t* words = (const uint32_t*)src;
+    uint32_t num_words = len / 4;
+    uint32_t out = 0;
+    uint32_t i = 0;
+
+    if (len % 4) {
+        return 0;
+    }
+    while (i < num_words) {
+        // find the start of the next run that's long enough, or the end of the page
+        uint32_t run = i;
+        while (run < num_words) {
+            uint32_t end = run;
+            while (end < num_words && words[end] == 0xFFFFFFFF) {
+                end++;
+            }
+            if (end - run >= RLE_MIN_RUN_WORDS || end == num_words) {
+                break;
+            }
+            run = end + 1;
+        }
+        uint32_t end = run;
+        while (end < num_words && words[end] == 0xFFFFFFFF) {
+            end++;
+        }
+
+        uint16_t lit_len = (run - i) * 4;
+        uint16_t run_len = (end - run) * 4;
+        if (out + lit_len + 4 > dst_max) {
+            return 0;
+        }
+        memcpy(dst + out, &lit_len, 2);
+        memcpy(dst + out + 2, src + i * 4, lit_len);
+        memcpy(dst + out + 2 + lit_len, &run_len, 2);
+        out += lit_len + 4;
+        i = end;
+    }
+    return out;
+}
+
+/// BCH check of streamed pages (DUMP_OPT_ECC). The data area is split into
+/// BCH_SECTOR_SIZE byte sectors, each protected by a t = 8 binary BCH code over
+/// GF(2^13) whose 13 ECC bytes sit at the end of the OOB, sector after sector.
+/// ECC bytes are the remainder of the sector (MSB of byte 0 first) times x^104
+/// modulo the generator, XORed with a mask that makes an erased sector's ECC all
+/// 0xFF. A clean sector costs one table step per byte (bch_remainder()); only if
+/// the remainder doesn't match are syndromes, Berlekamp-Massey and a Chien search
+/// run to find out how many bits flipped. Pages are sent as read, not corrected
+#define BCH_M 13
+#define BCH_N ((1 << BCH_M) - 1)
+#define BCH_T 8
+#define BCH_PRIM_POLY 0x201B // x^13 + x^4 + x^3 + x + 1
+#define BCH_ECC_BITS (BCH_M * BCH_T)
+#define BCH_ECC_BYTES ((BCH_ECC_BITS + 7) / 8)
+#define BCH_SECTOR_SIZE 512
+#define BCH_CODE_BITS (BCH_SECTOR_SIZE * 8 + BCH_ECC_BITS) // shortened code length
+#define BCH_MAX_SECTORS 16
+#define BCH_UNCORRECTABLE 0xFF
+
+uint16_t gf_exp[BCH_N];
+uint16_t gf_log[BCH_N + 1];
+
+// remainders are kept left aligned in 4 words, word 0 holding x^103..x^72
+uint32_t bch_mod8_tab[256][4];
+uint8_t bch_ecc_mask[BCH_ECC_BYTES];
+
+uint16_t gf_mul(uint16_t a, uint16_t b)
+{
+    return (a && b) ? gf_exp[(gf_log[a] + gf_log[b]) % BCH_N] : 0;
+}
+
+// Remainder of data(x) * x^104 modulo the generator
+void bch_remainder(const uint8_t* data, uint32_t len, uint32_t* rem)
+{
+    uint32_t r0 = 0, r1 = 0, r2 = 0, r3 = 0;
+
+    for (uint32_t i = 0; i < len; i++) {
+        const uint32_t* t = bch_mod8_tab[(r0 >> 24) ^ data[i]];
+        r0 = ((r0 << 8) | (r1 >> 24)) ^ t[0];
+        r1 = ((r1 << 8) | (r2 >> 24)) ^ t[1];
+        r2 = ((r2 << 8) | (r3 >> 24)) ^ t[2];
+        r3 = (r3 << 8) ^ t[3];
+    }
+    rem[0] = r0;
+    rem[1] = r1;
+    rem[2] = r2;
+    rem[3] = r3;
+}
+
+void init_bch()
+{
+    uint32_t x = 1;
+    for (int i = 0; i < BCH_N; i++) {
+        gf_exp[i] = x;
+        gf_log[x] = i;
+        x <<= 1;
+        if (x & (1 << BCH_M)) {
+            x ^= BCH_PRIM_POLY;
+        }
+    }
+    gf_log[0] = 0; // never used, gf_mul() checks for 0
+
+    // generator = product of the minimal polynomials of a^1, a^3, ... a^(2t - 1),
+    // as a bitmap with bit k the coefficient of x^k
+    uint32_t gen[4] = { 1, 0, 0, 0 };
+    for (int j = 1; j < 2 * BCH_T; j += 2) {
+        uint16_t min_poly[BCH_M + 2] = { 1 };
+        int deg = 0;
+        int e = j;
+        do {
+            // times (x + a^e)
+            for (int i = deg + 1; i > 0; i--) {
+                min_poly[i] = min_poly[i - 1] ^ gf_mul(min_poly[i], gf_exp[e]);
+            }
+            min_poly[0] = gf_mul(min_poly[0], gf_exp[e]);
+            deg++;
+            e = (e * 2) % BCH_N;
+        } while (e != j);
+
+        // the coefficients are all 0 or 1 by now
+        uint32_t prod[4] = { 0 };
+        for (int i = 0; i <= deg; i++) {
+            if (!min_poly[i]) {
+                continue;
+            }
+            for (int w = 3; w >= 0; w--) {
+                uint32_t shifted = gen[w] << i;
+                if (w > 0 && i > 0) {
+                    shifted |= gen[w - 1] >> (32 - i);
+                }
+                prod[w] ^= shifted;
+            }
+        }
+        memcpy(gen, prod, sizeof(gen));
+    }
+
+    // x^0..x^103 of the generator, left aligned like the remainders
+    uint32_t gen_low[4] = { 0 };
+    for (int k = 0; k < BCH_ECC_BITS; k++) {
+        if (gen[k / 32] & (1u << (k % 32))) {
+            int bit = k + (128 - BCH_ECC_BITS);
+            gen_low[3 - bit / 32] |= 1u << (bit % 32);
+        }
+    }
+
+    for (int i = 0; i < 256; i++) {
+        uint32_t r[4] = { 0 };
+        for (int b = 7; b >= 0; b--) {
+            bool feedback = ((r[0] >> 31) ^ (i >> b)) & 1;
+            r[0] = (r[0] << 1) | (r[1] >> 31);
+            r[1] = (r[1] << 1) | (r[2] >> 31);
+            r[2] = (r[2] << 1) | (r[3] >> 31);
+            r[3] <<= 1;
+            if (feedback) {
+                for (int w = 0; w < 4; w++) {
+                    r[w] ^= gen_low[w];
+                }
+            }
+        }
+        memcpy(bch_mod8_tab[i], r, sizeof(r));
+    }
+
+    uint8_t erased[BCH_SECTOR_SIZE];
+    uint32_t rem[4];
+    memset(erased, 0xFF, sizeof(erased));
+    bch_remainder(erased, sizeof(erased), rem);
+    for (int i = 0; i < BCH_ECC_BYTES; i++) {
+        bch_ecc_mask[i] = ~(rem[i / 4] >> (24 - 8 * (i % 4)));
+    }
+}
+
+/// Number of bits that flipped in a sector and its ECC bytes, BCH_UNCORRECTABLE
+/// if there are more than BCH_T
+uint8_t bch_check_sector(const uint8_t* data, const uint8_t* ecc)
+{
+    uint32_t rem[4];
+    uint8_t diff[BCH_ECC_BYTES];
+    bool clean = true;
+
+    bch_remainder(data, BCH_SECTOR_SIZE, rem);
+    for (int i = 0; i < BCH_ECC_BYTES; i++) {
+        diff[i] = (rem[i / 4] >> (24 - 8 * (i % 4))) ^ ecc[i] ^ bch_ecc_mask[i];
+        clean = clean && !diff[i];
+    }
+    if (clean) {
+        return 0;
+    }
+
+    // the received word is congruent to diff(x), so S_j = diff(a^j). Bit b of
+    // diff byte i is x^(103 - 8i - 7 + b)
+    uint16_t synd[2 * BCH_T + 1] = { 0 };
+    for (int i = 0; i < BCH_ECC_BYTES; i++) {
+        for (int b = 0; b < 8; b++) {
+            if (!(diff[i] & (1 << b))) {
+                continue;
+            }
+            int deg = BCH_ECC_BITS - 8 - 8 * i + b;
+            for (int j = 1; j < 2 * BCH_T; j += 2) {
+                synd[j] ^= gf_exp[(j * deg) % BCH_N];
+            }
+        }
+    }
+    for (int j = 2; j <= 2 * BCH_T; j += 2) {
+        synd[j] = gf_mul(synd[j / 2], synd[j / 2]);
+    }
+
+    // Berlekamp-Massey, lambda is the error locator
+    uint16_t lambda[2 * BCH_T + 1] = { 1 };
+    uint16_t prev[2 * BCH_T + 1] = { 1 };
+    uint16_t prev_disc = 1;
+    int len = 0;
+    int shift = 1;
+    for (int n = 0; n < 2 * BCH_T; n++) {
+        uint16_t disc = synd[n + 1];
+        for (int i = 1; i <= len; i++) {
+            disc ^= gf_mul(lambda[i], synd[n + 1 - i]);
+        }
+        if (!disc) {
+            shift++;
+            continue;
+        }
+
+        uint16_t scale = gf_exp[(gf_log[disc] + BCH_N - gf_log[prev_disc]) % BCH_N];
+        uint16_t saved[2 * BCH_T + 1];
+        memcpy(saved, lambda, sizeof(saved));
+        for (int i = 0; i + shift <= 2 * BCH_T; i++) {
+            lambda[i + shift] ^= gf_mul(scale, prev[i]);
+        }
+        if (2 * len <= n) {
+            len = n + 1 - len;
+            memcpy(prev, saved, sizeof(prev));
+            prev_disc = disc;
+            shift = 1;
+        } else {
+            shift++;
+        }
+    }
+    if (len > BCH_T) {
+        return BCH_UNCORRECTABLE;
+    }
+
+    // Chien search: an error at x^p is a root at a^-p. term[i] is the log of
+    // lambda[i] * a^(-i * p)
+    int term[BCH_T + 1];
+    for (int i = 1; i <= len; i++) {
+        term[i] = lambda[i] ? gf_log[lambda[i]] : -1;
+    }
+    int roots = 0;
+    for (int p = 0; p < BCH_CODE_BITS && roots < len; p++) {
+        uint16_t sum = 1;
+        for (int i = 1; i <= len; i++) {
+            if (term[i] >= 0) {
+                sum ^= gf_exp[term[i]];
+                term[i] = (term[i] + BCH_N - i) % BCH_N;
+            }
+        }
+        roots += !sum;
+    }
+    return roots == len ? len : BCH_UNCORRECTABLE;
+}
+
+/// Checks every sector of a page against the ECC bytes at the end of its OOB.
+/// status gets the bits flipped per sector (BCH_UNCORRECTABLE if too many).
+/// Returns the number of sectors, 0 if the ECC doesn't fit into the OOB
+uint32_t ecc_check_page(const uint8_t* page, uint32_t page_size, uint32_t oob_size, uint8_t* status)
+{
+    uint32_t sectors = page_size / BCH_SECTOR_SIZE;
+    if (sectors > BCH_MAX_SECTORS || sectors * BCH_ECC_BYTES > oob_size) {
+        return 0;
+    }
+
+    const uint8_t* ecc = page + page_size + oob_size - sectors * BCH_ECC_BYTES;
+    for (uint32_t s = 0; s < sectors; s++) {
+        status[s] = bch_check_sector(page + s * BCH_SECTOR_SIZE, ecc + s * BCH_ECC_BYTES);
+    }
+    return sectors;
+}
+
+// FRAME_ECC for a page that has just been sent, nothing if it is clean
+bool send_ecc_frame(uint32_t page, const uint8_t* data, uint32_t page_size, uint32_t oob_size)
+{
+    uint8_t status[BCH_MAX_SECTORS];
+    uint32_t num = ecc_check_page(data, page_size, oob_size, status);
+    bool flipped = false;
+
+    for (uint32_t i = 0; i < num; i++) {
+        if (status[i] == BCH_UNCORRECTABLE) {
+            stats_glob.ecc_uncorrectable++;
+        } else {
+            stats_glob.ecc_bits += status[i];
+        }
+        flipped = flipped || status[i];
+    }
+    return !flipped || send_frame(FRAME_ECC, page, status, num);
+}
+
+// Reads a little endian argument of n bytes following a command byte
+bool get_arg_bytes(int n, uint32_t* val)
+{
+    *val = 0;
+    for (int i = 0; i < n; i++) {
+        int b = getchar_timeout_us(2000000);
+        if (PICO_ERROR_TIMEOUT == b) {
+            return false;
+        }
+        *val |= (uint32_t)(b & 0xff) << (8 * i);
+    }
+    return true;
+}
+
+/// Drops whatever the host has sent until it goes quiet for a moment
+void discard_input()
+{
+    while (getchar_timeout_us(10000) != PICO_ERROR_TIMEOUT) {
+    }
+}
+
+/// Timing sweep. Takes reference reads of the ID bytes and a few pages at the
+/// current scale, then lowers the scale step by step until a read no longer
+/// matches. The chosen scale is one step above the fastest one that passed.
+/// WP is held low throughout so a mangled command byte can never turn into a
+/// program or erase.
+#define TUNE_PAGES 4
+#define TUNE_REPEATS 2
+#define TUNE_STEP_PCT 10
+#define MIN_TIMING_SCALE_PCT 10
+
+bool tune_pass(nand_pins_t* pins, uint32_t start_page, uint8_t* buf, uint32_t page_size, id_data_t* id, uint32_t* crcs)
+{
+    if (!read_id(pins, id)) {
+        return false;
+    }
+    for (int i = 0; i < TUNE_PAGES; i++) {
+        if (!read_page(pins, start_page + i, buf, page_size, &crcs[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+uint32_t tune_timing(nand_pins_t* pins, uint32_t start_page, uint8_t* buf, uint32_t page_size)
+{
+    const nand_timing_t* timing = timing_glob;
+    uint32_t start_pct = timing_scale_pct;
+    uint32_t best_pct = start_pct;
+    id_data_t ref_id, id;
+    uint32_t ref_crcs[TUNE_PAGES], crcs[TUNE_PAGES];
+
+    gpio_put(pins->wp, false);
+
+    if (tune_pass(pins, start_page, buf, page_size, &ref_id, ref_crcs)) {
+        for (int pct = (int)start_pct - TUNE_STEP_PCT; pct >= MIN_TIMING_SCALE_PCT; pct -= TUNE_STEP_PCT) {
+            apply_timing(timing, pct);
+
+            bool ok = true;
+            for (int r = 0; r < TUNE_REPEATS && ok; r++) {
+                ok = tune_pass(pins, start_page, buf, page_size, &id, crcs)
+                    && memcmp(&id, &ref_id, sizeof(id)) == 0
+                    && memcmp(crcs, ref_crcs, sizeof(crcs)) == 0;
+            }
+            if (!ok) {
+                break;
+            }
+            best_pct = pct;
+        }
+    }
+
+    uint32_t chosen = MIN(best_pct + TUNE_STEP_PCT, start_pct);
+    apply_timing(timing, chosen);
+    reset_nand(pins); // the last attempt may have left it confused
+    gpio_put(pins->wp, true);
+    return chosen;
+}
+
+/// CMD_BENCH. Each test runs count times starting at a page and measures one
+/// thing in isolation, the NAND is only read:
+///   BENCH_BUS      - page data out only, the page is loaded (and RY waited for)
+///                    before the clock starts and thrown away afterwards
+///   BENCH_USB      - count synthetic FRAME_PAGE frames, the NAND isn't touched
+///   BENCH_CMD_ADDR - a read command and full address, without the 0x30 that
+///                    would start the array read
+///   BENCH_TR       - 0x30 to RY going high again, i.e. tR as the chip reports it
+typedef enum bench_mode_enum {
+    BENCH_BUS = 0,
+    BENCH_USB = 1,
+    BENCH_CMD_ADDR = 2,
+    BENCH_TR = 3,
+    NUM_BENCH_MODES
+} bench_mode_t;
+
+const char* BENCH_NAMES[NUM_BENCH_MODES] = { "bus", "usb", "cmd_addr", "tR" };
+
+typedef struct {
+    uint32_t iterations;
+    uint32_t timeouts;
+    uint64_t total_us;
+    uint32_t min_us;
+    uint32_t max_us;
+    uint64_t bytes;
+} bench_result_t;
+
+// written by core1 for CMD_BENCH, read by core0 once the result has been posted
+bench_result_t bench_glob = { 0 };
+
+void bench_add(bench_result_t* bench, uint32_t us, uint32_t bytes)
+{
+    bench->iterations++;
+    bench->total_us += us;
+    bench->min_us = MIN(bench->min_us, us);
+    bench->max_us = MAX(bench->max_us, us);
+    bench->bytes += bytes;
+}
+
+// core1 side of the NAND tests, buf has to hold a page + oob
+void run_bench(nand_pins_t* pins, bench_mode_t mode, uint32_t start_page, uint32_t count, uint8_t* buf, uint32_t page_size)
+{
+    memset(&bench_glob, 0, sizeof(bench_glob));
+    bench_glob.min_us = UINT32_MAX;
+
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t page = start_page + i;
+        uint32_t crc;
+        uint32_t start;
+
+        switch (mode) {
+        case BENCH_BUS:
+            issue_page_read(pins, page);
+            if (!wait_ready(pins, READY_TIMEOUT_US)) {
+                bench_glob.timeouts++;
+                reset_nand(pins);
+                continue;
+            }
+            start = time_us_32();
+            read_data(pins, buf, page_size, &crc); // RY is already high, so this is the transfer alone
+            bench_add(&bench_glob, time_us_32() - start, page_size);
+            break;
+
+        case BENCH_CMD_ADDR:
+            start = time_us_32();
+            write_cmd(pins, 0x00);
+            write_addr(pins, page, 0);
+            bench_add(&bench_glob, time_us_32() - start, 0);
+            break;
+
+        case BENCH_TR:
+            write_cmd(pins, 0x00);
+            write_addr(pins, page, 0);
+            write_cmd(pins, 0x30);
+            start = time_us_32();
+            prepare_data_out(pins);
+            if (!wait_ready(pins, READY_TIMEOUT_US)) {
+                bench_glob.timeouts++;
+                reset_nand(pins);
+                continue;
+            }
+            bench_add(&bench_glob, time_us_32() - start, 0);
+            break;
+
+        default:
+            return;
+        }
+    }
+    reset_nand(pins); // nothing may be left half issued
+}
+
+void print_bench(bench_mode_t mode, const bench_result_t* bench)
+{
+    uint64_t kb_per_sec = bench->total_us ? bench->bytes * 1000 / bench->total_us : 0;
+    uint64_t ns_per_iteration = bench->iterations ? bench->total_us * 1000 / bench->iterations : 0;
+
+    printf("%s: iterations=%lu timeouts=%lu total_us=%llu min_us=%lu max_us=%lu bytes=%llu kb_per_sec=%llu ns_per_iteration=%llu\n",
+        BENCH_NAMES[mode], (unsigned long)bench->iterations, (unsigned long)bench->timeouts,
+        (unsigned long long)bench->total_us, (unsigned long)(bench->iterations ? bench->min_us : 0),
+        (unsigned long)bench->max_us, (unsigned long long)bench->bytes,
+        (unsigned long long)kb_per_sec, (unsigned long long)ns_per_iteration);
+    printf("end\n");
+}
+
+/// CMD_CAPTURE. The nand_capture SM samples all GPIOs at clk_sys / divider while
+/// a single page read runs, until the read is done or the buffer is full. The
+/// FRAME_CAPTURE payload is a capture_hdr_t followed by the samples, one word each
+/// with bit n the level of GPIO n, so the header is kept right in front of them
+#define CAPTURE_SAMPLES 8192
+
+typedef struct __attribute__((packed)) {
+    uint32_t sample_rate_hz;
+    uint32_t num_samples;
+    uint8_t read_ok; // the read itself went through, RY didn't time out
+    uint8_t io_start;
+    uint8_t cle;
+    uint8_t ale;
+    uint8_t ce;
+    uint8_t re;
+    uint8_t we;
+    uint8_t ry;
+} capture_hdr_t;
+
+uint32_t capture_frame[FRAME_HDR_SPACE / 4 + sizeof(capture_hdr_t) / 4 + CAPTURE_SAMPLES];
+uint32_t* const capture_buffer = capture_frame + FRAME_HDR_SPACE / 4;
+
+// core1, buf takes the page itself
+void capture_read(nand_pins_t* pins, uint32_t page_num, uint32_t clkdiv, uint8_t* buf, uint32_t page_size)
+{
+    capture_hdr_t* hdr = (capture_hdr_t*)capture_buffer;
+    uint32_t* samples = capture_buffer + sizeof(capture_hdr_t) / 4;
+    uint32_t crc;
+
+    pio_sm_set_enabled(nand_pio, nand_capture_sm, false);
+    pio_sm_clear_fifos(nand_pio, nand_capture_sm);
+    pio_sm_set_clkdiv(nand_pio, nand_capture_sm, clkdiv);
+    pio_sm_restart(nand_pio, nand_capture_sm);
+
+    dma_channel_config c = dma_channel_get_default_config(capture_dma_chan);
+    channel_config_set_transfer_data_size(&c, DMA_SIZE_32);
+    channel_config_set_read_increment(&c, false);
+    channel_config_set_write_increment(&c, true);
+    channel_config_set_dreq(&c, pio_get_dreq(nand_pio, nand_capture_sm, false));
+    dma_channel_configure(capture_dma_chan, &c, samples, &nand_pio->rxf[nand_capture_sm], CAPTURE_SAMPLES, true);
+
+    pio_sm_set_enabled(nand_pio, nand_capture_sm, true);
+    hdr->read_ok = read_page(pins, page_num, buf, page_size, &crc);
+    pio_sm_set_enabled(nand_pio, nand_capture_sm, false);
+
+    // what is still in the FIFO belongs to the capture too
+    while (dma_channel_is_busy(capture_dma_chan) && !pio_sm_is_rx_fifo_empty(nand_pio, nand_capture_sm)) {
+        tight_loop_contents();
+    }
+    hdr->num_samples = CAPTURE_SAMPLES - dma_channel_hw_addr(capture_dma_chan)->transfer_count;
+    dma_channel_abort(capture_dma_chan);
+
+    hdr->sample_rate_hz = clock_get_hz(clk_sys) / clkdiv;
+    hdr->io_start = pins->io_start;
+    hdr->cle = pins->cle;
+    hdr->ale = pins->ale;
+    hdr->ce = pins->ce;
+    hdr->re = pins->re;
+    hdr->we = pins->we;
+    hdr->ry = pins->ry;
+}
+
+// clk_sys range CMD_SET_SYS_CLOCK accepts. Above 200MHz the core voltage is raised a notch
+#define MIN_SYS_CLOCK_KHZ 100000
+#define MAX_SYS_CLOCK_KHZ 250000
+#define SYS_CLOCK_VREG_BUMP_KHZ 200000
+
+// Changes clk_sys and recomputes every bus delay so the NAND timing stays legal.
+// Same restriction as apply_timing(), the bus has to be idle
+bool set_sys_clock(uint32_t khz)
+{
+    uint vco_freq, post_div1, post_div2;
+
+    if (khz < MIN_SYS_CLOCK_KHZ || khz > MAX_SYS_CLOCK_KHZ || !check_sys_clock_khz(khz, &vco_freq, &post_div1, &post_div2)) {
+        return false;
+    }
+
+    if (khz > SYS_CLOCK_VREG_BUMP_KHZ) {
+        vreg_set_voltage(VREG_VOLTAGE_1_15);
+        busy_wait_us_32(100); // let the regulator settle before speeding up
+    }
+    set_sys_clock_khz(khz, true);
+    if (khz <= SYS_CLOCK_VREG_BUMP_KHZ) {
+        vreg_set_voltage(VREG_VOLTAGE_DEFAULT);
+    }
+
+    apply_timing(timing_glob, timing_scale_pct);
+    return true;
+}
+
+int cmd_from_char(char c)
+{
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'z') {
+        return c - 'a' + 10;
+    }
+    return -1;
+}
+
+// Commands that talk to the chip, refused while there is no probed chip
+bool cmd_needs_nand(int cmd)
+{
+    switch (cmd) {
+    case CMD_READ_PAGE:
+    case CMD_GET_FLASH_INFO:
+    case CMD_DUMP_PAGES:
+    case CMD_TUNE_TIMING:
+    case CMD_SCAN_BAD_BLOCKS:
+    case CMD_VOTE_PAGE:
+    case CMD_BENCH:
+    case CMD_CAPTURE:
+    case CMD_ERASE:
+    case CMD_PROGRAM:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// Shared State between cores
+queue_t cmd_queue = { 0 };
+queue_t results_queue = { 0 };
+nand_pins_t pins_glob = { 0 };
+flash_info_struct flash_info_glob = { 0 };
+
+/// Page buffer pool. free_queue holds pointers to the buffers nobody owns. Core1
+/// takes one for every page it reads and passes it to core0 in result_t.alloc,
+/// core0 gives it back with release_buffer() once the page has been sent, so a
+/// buffer is only ever touched by one core and the data is never copied. When
+/// core0 falls behind core1 blocks in acquire_buffer(), so a range read runs at
+/// most NUM_PAGE_BUFFERS pages ahead of the USB side. The pointers handed out are
+/// FRAME_HDR_SPACE bytes into each buffer, so pages can be sent in place
+#define NUM_PAGE_BUFFERS 8
+#define PAGE_BUFFER_SIZE 9216 // up to 8K pages with 1K oob
+uint8_t page_buffers[NUM_PAGE_BUFFERS][FRAME_HDR_SPACE + PAGE_BUFFER_SIZE] __attribute__((aligned(4)));
+queue_t free_queue = { 0 };
+
+// CMD_PROGRAM, core0 -> core1: pool buffers holding the pages to program, in
+// page order. NULL for pages the host never sent
+queue_t program_queue = { 0 };
+
+// core0 only, DUMP_OPT_RLE pages are encoded into this
+uint8_t rle_frame[FRAME_HDR_SPACE + PAGE_BUFFER_SIZE];
+uint8_t* const rle_buffer = rle_frame + FRAME_HDR_SPACE;
+
+// core0 only, (page, crc) pairs collected for the next FRAME_HASH
+#define HASH_BATCH 512
+uint32_t hash_frame[FRAME_HDR_SPACE / 4 + HASH_BATCH * 2];
+uint32_t (*const hash_buffer)[2] = (uint32_t(*)[2])(hash_frame + FRAME_HDR_SPACE / 4);
+uint32_t hash_count = 0;
+
+bool flush_hashes()
+{
+    bool sent = !hash_count || send_frame(FRAME_HASH, hash_count, (uint8_t*)hash_buffer, hash_count * sizeof(hash_buffer[0]));
+    hash_count = 0;
+    return sent;
+}
+
+// Set by core0 to make core1 skip the rest of a CMD_READ_RANGE
+volatile bool abort_range = false;
+
+void init_page_buffers()
+{
+    queue_init(&free_queue, sizeof(uint8_t*), NUM_PAGE_BUFFERS);
+    queue_init(&program_queue, sizeof(uint8_t*), NUM_PAGE_BUFFERS);
+    for (int i = 0; i < NUM_PAGE_BUFFERS; i++) {
+        uint8_t* buff = page_buffers[i] + FRAME_HDR_SPACE;
+        queue_add_blocking(&free_queue, &buff);
+    }
+}
+
+// Takes a buffer out of the pool, blocking until one is free
+uint8_t* acquire_buffer()
+{
+    uint8_t* buff;
+    queue_remove_blocking(&free_queue, &buff);
+    return buff;
+}
+
+void free_buffer(uint8_t* buff)
+{
+    queue_add_blocking(&free_queue, &buff);
+}
+
+// Returns the buffer a result owns, if any, to the pool
+void release_buffer(result_t* res)
+{
+    if (res->alloc) {
+        free_buffer(res->alloc);
+        res->alloc = NULL;
+    }
+}
+
+// core0 side: set while a read-ahead CMD_READ_PAGE is in flight
+bool prefetch_pending = false;
+
+void request_page(uint32_t flags)
+{
+    cmd_t cmd_arg = { CMD_READ_PAGE, flags };
+    queue_add_blocking(&cmd_queue, &cmd_arg);
+    prefetch_pending = true;
+}
+
+// Pops an outstanding read-ahead page so core1 is idle again. Unless the caller is
+// about to move the page counter anyway, rewind it so the prefetched page isn't skipped
+void cancel_prefetch(bool rewind)
+{
+    if (!prefetch_pending) {
+        return;
+    }
+
+    result_t res = { 0 };
+    queue_remove_blocking(&results_queue, &res);
+    release_buffer(&res);
+    prefetch_pending = false;
+
+    if (rewind) {
+        cmd_t cmd_arg = { CMD_SET_PAGE_NO, res.page };
+        queue_add_blocking(&cmd_queue, &cmd_arg);
+        queue_remove_blocking(&results_queue, &res);
+    }
+}
+
+// Streams count pages starting at start_page as FRAME_PAGE frames. The whole range
+// goes to core1 as one CMD_READ_RANGE, which keeps reading ahead into the buffer pool
+// while core0 sends. Leaves the page counter at start_page + count
+void dump_pages(uint32_t start_page, uint32_t count, uint8_t options)
+{
+    uint32_t max_sz = flash_info_glob.page_size_bytes + flash_info_glob.oob_size_bytes;
+    uint32_t num_results = (options & DUMP_OPT_STRIPE) ? count * pins_glob.num_chips : count;
+    result_t res = { 0 };
+    bool sending = true;
+    uint32_t rle_len = 0;
+
+    stdio_flush(); // anything printed before goes out ahead of the frames
+    cancel_prefetch(false);
+
+    uint64_t dump_start = time_us_64();
+    abort_range = false;
+    hash_count = 0;
+    cmd_t cmd_arg = { CMD_READ_RANGE, start_page, count, options };
+    queue_add_blocking(&cmd_queue, &cmd_arg);
+
+    // core1 posts exactly one result per page (and chip), even after an abort
+    for (uint32_t i = 0; i < num_results; i++) {
+        queue_remove_blocking(&results_queue, &res);
+
+        if (sending) {
+            uint64_t send_start = time_us_64();
+            bool sent;
+            if (res.status == RESULT_BAD_BLOCK) {
+                sent = send_frame(FRAME_BAD_BLOCK, res.page, NULL, 0);
+            } else if (res.status != RESULT_OK || res.sz <= 0 || res.sz > max_sz || !res.alloc) {
+                sent = send_frame(FRAME_ERROR, res.page, NULL, 0);
+            } else if (options & DUMP_OPT_HASH) {
+                // the CRC came for free with the read, the page itself isn't needed
+                hash_buffer[hash_count][0] = res.page;
+                hash_buffer[hash_count][1] = res.crc;
+                hash_count++;
+                sent = hash_count < HASH_BATCH || flush_hashes();
+            } else {
+                uint8_t* page_buff = res.alloc;
+                if (res.erased) {
+                    sent = send_frame_crc(FRAME_ERASED, res.page, NULL, 0, erased_crc(res.sz));
+                } else if ((options & DUMP_OPT_RLE) && (rle_len = rle_encode(page_buff, res.sz, rle_buffer, res.sz - 1))) {
+                    sent = send_frame_crc(FRAME_PAGE_RLE, res.page, rle_buffer, rle_len, res.crc);
+                } else {
+                    sent = send_frame_crc(FRAME_PAGE, res.page, page_buff, res.sz, res.crc);
+                }
+                if (sent && (options & DUMP_OPT_ECC) && !res.erased) {
+                    sent = send_ecc_frame(res.page, page_buff, flash_info_glob.page_size_bytes, flash_info_glob.oob_size_bytes);
+                }
+                stats_glob.pages_sent++;
+            }
+            stats_add(STAGE_USB, time_us_64() - send_start);
+
+            if (!sent) {
+                abort_range = true; // host went away, let core1 wind down
+                sending = false;
+            }
+        }
+        release_buffer(&res);
+    }
+
+    if (sending && flush_hashes()) {
+        send_frame(FRAME_END, start_page + count, NULL, 0);
+        stream_flush();
+    }
+    stats_glob.dump_us += time_us_64() - dump_start;
+}
+
+// FRAME_BAD_BLOCK or FRAME_ERROR for a CMD_ERASE/CMD_PROGRAM result that isn't OK
+void send_program_result(result_t* res)
+{
+    if (res->status == RESULT_BAD_BLOCK) {
+        send_frame(FRAME_BAD_BLOCK, res->page, NULL, 0);
+    } else if (res->status != RESULT_OK) {
+        send_frame(FRAME_ERROR, res->page, NULL, 0);
+    }
+}
+
+/// CMD_PROGRAM on core0. The pages are read from USB straight into pool buffers
+/// and queued to core1, so the next page comes in over USB while the current one
+/// programs. Results are drained between pages, core1 must never be left
+/// blocking on a full results_queue while core0 waits for a buffer. If the host
+/// stops sending, core1 gets NULL for the rest of the range
+void program_pages(uint32_t start_page, uint32_t count, uint8_t options)
+{
+    uint32_t page_size = flash_info_glob.page_size_bytes + flash_info_glob.oob_size_bytes;
+    uint32_t queued = 0;
+    uint32_t done = 0;
+    bool receiving = true;
+    bool have_next = false;
+    uint8_t* next = NULL;
+    result_t res = { 0 };
+
+    stdio_flush();
+    cancel_prefetch(true);
+    cmd_t cmd_arg = { CMD_PROGRAM_RANGE, start_page, count, options };
+    queue_add_blocking(&cmd_queue, &cmd_arg);
+
+    while (done < count) {
+        if (queue_try_remove(&results_queue, &res)) {
+            send_program_result(&res);
+            done++;
+            continue;
+        }
+        if (!have_next && queued < count) {
+            if (!receiving) {
+                next = NULL;
+                have_next = true;
+            } else if (queue_try_remove(&free_queue, &next)) {
+                have_next = true;
+                if (!stream_read(next, page_size)) {
+                    free_buffer(next);
+                    next = NULL;
+                    receiving = false;
+                }
+            }
+        }
+        if (have_next && queue_try_add(&program_queue, &next)) {
+            have_next = false;
+            queued++;
+        }
+    }
+
+    if (!receiving) {
+        discard_input(); // whatever of the pages is still on its way
+    }
+    send_frame(FRAME_END, start_page + count, NULL, 0);
+    stream_flush();
+}
+
+// Reads one page into a buffer from the pool, blocking until core0 frees one
+void read_page_into_buffer(cache_read_state_t* cache_state, uint32_t page_num, uint32_t flags, result_t* result)
+{
+    result->sz = flash_info_glob.page_size_bytes + flash_info_glob.oob_size_bytes; // TODO adjust this for other page sizes
+    result->page = page_num;
+    result->alloc = acquire_buffer();
+
+    uint8_t* page_buff = result->alloc;
+    bool ok;
+    if (flags & READ_FLAG_CACHE) {
+        ok = read_page_cached(&pins_glob, cache_state, page_num, page_buff, result->sz, flags & READ_FLAG_LAST, &result->crc);
+    } else {
+        end_cache_read(&pins_glob, cache_state);
+        ok = read_page(&pins_glob, page_num, page_buff, result->sz, &result->crc);
+    }
+    result->status = ok ? RESULT_OK : RESULT_TIMEOUT;
+}
+
+// Fills in result for a page of a range that won't be read, because the range
+// was aborted or the page is in a bad block that should be skipped
+bool range_page_skipped(cmd_t* cmd_arg, uint32_t page, result_t* result)
+{
+    bool bad = (cmd_arg->options & DUMP_OPT_SKIP_BAD) && is_block_bad(0, page / flash_info_glob.pages_per_block);
+
+    if (!abort_range && !bad) {
+        return false;
+    }
+    result->sz = 0;
+    result->alloc = NULL;
+    result->page = page;
+    result->status = abort_range ? RESULT_OK : RESULT_BAD_BLOCK;
+    return true;
+}
+
+// Recovers from a failed read, flags erased pages and hands the page (and its
+// buffer) to core0
+void post_range_page(cmd_t* cmd_arg, result_t* result)
+{
+    if (result->status == RESULT_TIMEOUT) {
+        reset_nand(&pins_glob);
+    }
+    result->erased = (cmd_arg->options & DUMP_OPT_ERASED) && result->status == RESULT_OK
+        && result->alloc && is_erased(result->alloc, result->sz);
+    queue_add_blocking(&results_queue, result);
+    result->alloc = NULL; // core0's now
+}
+
+/// Range read on a two plane chip. Every page of an even block is read together
+/// with the same page of the next block when that is part of the range too, so
+/// results come out of page order (the frames carry the page number anyway).
+/// Anything without a partner, or whose partner is skipped, is read on its own
+void read_range_multiplane(cmd_t* cmd_arg, cache_read_state_t* cache_state, result_t* result)
+{
+    uint32_t ppb = flash_info_glob.pages_per_block;
+    uint32_t end = cmd_arg->arg + cmd_arg->count;
+    result_t results[2] = { *result, *result };
+
+    for (uint32_t page = cmd_arg->arg; page < end; page++) {
+        bool odd = (page / ppb) & 1;
+        if (odd && page >= cmd_arg->arg + ppb) {
+            continue; // already read along with the even block
+        }
+
+        uint32_t pages[2] = { page, page + ppb };
+        int num = (!odd && pages[1] < end) ? 2 : 1;
+        bool skipped[2] = { false, false };
+        for (int i = 0; i < num; i++) {
+            skipped[i] = range_page_skipped(cmd_arg, pages[i], &results[i]);
+        }
+
+        if (num == 2 && !skipped[0] && !skipped[1]) {
+            uint8_t* buffs[2];
+            uint32_t crcs[2];
+            for (int i = 0; i < 2; i++) {
+                results[i].sz = flash_info_glob.page_size_bytes + flash_info_glob.oob_size_bytes;
+                results[i].page = pages[i];
+                results[i].alloc = acquire_buffer();
+                buffs[i] = results[i].alloc;
+            }
+            bool ok = read_pages_multiplane(&pins_glob, pages, buffs, results[0].sz, crcs);
+            for (int i = 0; i < 2; i++) {
+                results[i].crc = crcs[i];
+                results[i].status = ok ? RESULT_OK : RESULT_TIMEOUT;
+            }
+        } else {
+            for (int i = 0; i < num; i++) {
+                if (!skipped[i]) {
+                    read_page_into_buffer(cache_state, pages[i], 0, &results[i]);
+                }
+            }
+        }
+
+        for (int i = 0; i < num; i++) {
+            post_range_page(cmd_arg, &results[i]);
+        }
+    }
+}
+
+/// Striped reads across chips. Every chip keeps a page read in flight: while one
+/// chip clocks its page out the others sit in tR, so with two chips the array
+/// reads hide behind the transfers. Posts one result per page and chip, chip
+/// order within a page, and leaves chip 0 selected. With DUMP_OPT_SKIP_BAD a
+/// chip's pages in its own bad blocks are neither loaded nor read
+void read_range_striped(cmd_t* cmd_arg, result_t* result)
+{
+    uint32_t sz = flash_info_glob.page_size_bytes + flash_info_glob.oob_size_bytes;
+    uint32_t ppb = flash_info_glob.pages_per_block;
+    bool skip_bad = cmd_arg->options & DUMP_OPT_SKIP_BAD;
+    uint32_t setup_us[MAX_CHIPS];
+
+    for (int c = 0; c < pins_glob.num_chips; c++) {
+        if (skip_bad && is_block_bad(c, cmd_arg->arg / ppb)) {
+            continue;
+        }
+        uint64_t start = time_us_64();
+        select_chip(&pins_glob, c);
+        issue_page_read(&pins_glob, cmd_arg->arg);
+        setup_us[c] = time_us_64() - start;
+    }
+
+    for (uint32_t i = 0; i < cmd_arg->count; i++) {
+        uint32_t page = cmd_arg->arg + i;
+
+        for (int c = 0; c < pins_glob.num_chips; c++) {
+            result->page = page | ((uint32_t)c << FRAME_CHIP_SHIFT);
+            result->sz = 0;
+            result->alloc = NULL;
+            result->status = RESULT_OK;
+            result->erased = false;
+
+            if (skip_bad && is_block_bad(c, page / ppb)) {
+                result->status = RESULT_BAD_BLOCK;
+            } else if (!abort_range) {
+                result->sz = sz;
+                result->alloc = acquire_buffer();
+                uint8_t* page_buff = result->alloc;
+
+                select_chip(&pins_glob, c);
+                uint64_t wait_start = time_us_64();
+                if (read_data(&pins_glob, page_buff, sz, &result->crc)) {
+                    stats_record_page(setup_us[c], 0, wait_start);
+                    result->erased = (cmd_arg->options & DUMP_OPT_ERASED) && is_erased(page_buff, sz);
+                } else {
+                    result->status = RESULT_TIMEOUT;
+                    reset_nand(&pins_glob);
+                }
+            }
+
+            // this chip's next page loads while the other chips are read out. Also
+            // after a page in a bad block, or the first good page would never load
+            if (!abort_range && i + 1 < cmd_arg->count && !(skip_bad && is_block_bad(c, (page + 1) / ppb))) {
+                uint64_t start = time_us_64();
+                select_chip(&pins_glob, c);
+                issue_page_read(&pins_glob, page + 1);
+                setup_us[c] = time_us_64() - start;
+            }
+            queue_add_blocking(&results_queue, result);
+            result->alloc = NULL;
+        }
+    }
+
+    // after an abort reads may still be in flight, let them finish
+    for (int c = pins_glob.num_chips - 1; c >= 0; c--) {
+        select_chip(&pins_glob, c);
+        wait_ready(&pins_glob, READY_TIMEOUT_US);
+    }
+}
+
+// CMD_READ_PAGE flags for page i of a range
+uint32_t range_read_flags(uint32_t page, uint32_t i, uint32_t count, uint8_t options)
+{
+    if (!(options & DUMP_OPT_CACHE_READ) || !flash_info_glob.cache_read) {
+        return 0;
+    }
+
+    bool last = (i + 1 == count) || ((page + 1) % flash_info_glob.pages_per_block == 0);
+    return READ_FLAG_CACHE | (last ? READ_FLAG_LAST : 0);
+}
+
+// Blocks with a bad block marker are never erased or programmed, that would lose the marker
+bool is_block_writable(uint32_t block)
+{
+    // past bbt_num_blocks (beyond MAX_BLOCKS or the chip) nothing is known about the marker
+    return block < bbt_num_blocks && !is_block_bad(0, block);
+}
+
+void ensure_bbt()
+{
+    if (bbt_num_blocks == 0) {
+        scan_bad_blocks(&pins_glob, flash_info_glob.num_blocks, flash_info_glob.pages_per_block, flash_info_glob.page_size_bytes);
+    }
+}
+
+// Status register after a program/erase to a result, fail_bit picks the page it is about
+result_status_t program_result(uint8_t status, uint8_t fail_bit)
+{
+    if (!(status & NAND_STATUS_READY)) {
+        return RESULT_TIMEOUT;
+    }
+    return (status & fail_bit) ? RESULT_FAIL : RESULT_OK;
+}
+
+void post_program_result(uint32_t page, result_status_t status)
+{
+    result_t result = { .status = status, .page = page };
+    queue_add_blocking(&results_queue, &result);
+}
+
+/// CMD_ERASE, one result per block
+void erase_range(cmd_t* cmd_arg)
+{
+    uint32_t ppb = flash_info_glob.pages_per_block;
+
+    ensure_bbt();
+    for (uint32_t block = cmd_arg->arg; block < cmd_arg->arg + cmd_arg->count; block++) {
+        result_status_t status = RESULT_FAIL;
+        if (is_block_bad(0, block)) {
+            status = RESULT_BAD_BLOCK;
+        } else if (is_block_writable(block)) {
+            status = program_result(erase_block(&pins_glob, block * ppb), NAND_STATUS_FAIL);
+        }
+        if (status == RESULT_TIMEOUT) {
+            reset_nand(&pins_glob);
+        }
+        post_program_result(block, status);
+    }
+}
+
+/// CMD_PROGRAM_RANGE. Takes the pages from program_queue as core0 receives them
+/// and posts one result per page. With PROGRAM_OPT_CACHE every page but the last
+/// of the range or of its block goes in with 0x15, so core0 can be filling the
+/// next buffer and the bus clocking in the next page while the array programs.
+/// A cache programmed page is pending until the next program command reports on
+/// it, so results aren't always in page order
+void program_range(cmd_t* cmd_arg)
+{
+    uint32_t ppb = flash_info_glob.pages_per_block;
+    uint32_t page_size = flash_info_glob.page_size_bytes + flash_info_glob.oob_size_bytes;
+    bool use_cache = (cmd_arg->options & PROGRAM_OPT_CACHE) && flash_info_glob.cache_program;
+    bool pending = false;
+    uint32_t pending_page = 0;
+
+    ensure_bbt();
+    for (uint32_t i = 0; i < cmd_arg->count; i++) {
+        uint32_t page = cmd_arg->arg + i;
+        bool end_of_run = i + 1 == cmd_arg->count || (page + 1) % ppb == 0;
+        result_status_t status = RESULT_OK;
+        uint8_t* buff;
+        queue_remove_blocking(&program_queue, &buff);
+
+        if (!buff) {
+            status = RESULT_TIMEOUT; // never arrived, nothing programmed
+        } else if (is_block_bad(0, page / ppb)) {
+            status = RESULT_BAD_BLOCK;
+        } else if (!is_block_writable(page / ppb)) {
+            status = RESULT_FAIL;
+        } else if (!(cmd_arg->options & PROGRAM_OPT_SKIP_ERASED) || !is_erased(buff, page_size)) {
+            bool cache = use_cache && !end_of_run;
+            uint8_t nand_status = program_page(&pins_glob, page, buff, page_size, cache);
+            if (pending) {
+                post_program_result(pending_page, program_result(nand_status, NAND_STATUS_FAILC));
+                pending = false;
+            }
+            if (cache && (nand_status & NAND_STATUS_READY)) {
+                pending = true;
+                pending_page = page;
+            } else {
+                status = program_result(nand_status, NAND_STATUS_FAIL);
+            }
+        }
+        if (buff) {
+            free_buffer(buff);
+        }
+
+        // skipped the page that would have ended the cache program run
+        if (pending && pending_page != page && (end_of_run || !buff)) {
+            post_program_result(pending_page, program_result(finish_cache_program(&pins_glob), NAND_STATUS_FAIL));
+            pending = false;
+        }
+        if (status == RESULT_TIMEOUT && buff) {
+            reset_nand(&pins_glob);
+        }
+        if (!(pending && pending_page == page)) {
+            post_program_result(page, status);
+        }
+    }
+}
+
+/// Result of the last probe_nand(), NAND commands are refused until one succeeded
+typedef enum {
+    PROBE_OK = 0,
+    PROBE_NO_CHIP,
+    PROBE_IO_WIDTH,
+    PROBE_UNKNOWN_ID,
+    PROBE_PAGE_TOO_LARGE,
+} probe_result_t;
+
+const char* const PROBE_MESSAGES[] = { "OK", "No NAND chip answered the ID command", "Unsupported I/O width",
+    "Unrecognized NAND flash ID bytes", "Page size too large" };
+probe_result_t probe_glob = PROBE_NO_CHIP;
+id_data_t probed_id_glob = { 0 }; // ID of the last successful probe
+
+/// Resets and identifies the chip(s), then sets up everything that depends on the
+/// part: flash_info_glob, chip count, address cycles, page kernel and timing. Runs
+/// at startup and for CMD_PROBE, so chips can be swapped without a power cycle.
+/// Forgets the bad block table, which belonged to the previous chip. The timing
+/// scale (set with 9 or tuned with 8) is kept if the same part answers again,
+/// since the wiring it was tuned for hasn't changed; a new part starts over
+probe_result_t probe_nand(id_data_t* id_data)
+{
+    uint32_t scale_pct = timing_scale_pct;
+
+    memset(&flash_info_glob, 0, sizeof(flash_info_glob));
+    memset(id_data, 0, sizeof(*id_data));
+    bbt_num_blocks = 0;
+    pins_glob.num_chips = 1;
+    apply_timing(&TIMING_ONFI_MODES[0], DEFAULT_TIMING_SCALE_PCT); // until we know what chip this is
+
+    select_chip(&pins_glob, 0);
+    reset_nand(&pins_glob);
+    if (!read_id(&pins_glob, id_data) || id_data->maker == 0x00 || id_data->maker == 0xFF) {
+        return PROBE_NO_CHIP;
+    }
+
+    // any further chips have to be the same part
+    for (int c = 1; c < MAX_CHIPS; c++) {
+        id_data_t chip_id = { 0 };
+        select_chip(&pins_glob, c);
+        reset_nand(&pins_glob);
+        if (!read_id(&pins_glob, &chip_id) || memcmp(&chip_id, id_data, sizeof(*id_data)) != 0) {
+            break;
+        }
+        pins_glob.num_chips++;
+    }
+    select_chip(&pins_glob, 0);
+
+    if (!check_supported_io_width(id_data)) {
+        return PROBE_IO_WIDTH;
+    }
+
+    flash_info_struct flash_info = { 0 };
+    if (!get_flash_info(&pins_glob, id_data, &flash_info)) {
+        return PROBE_UNKNOWN_ID;
+    }
+
+    if (flash_info.page_size_bytes + flash_info.oob_size_bytes > PAGE_BUFFER_SIZE) {
+        return PROBE_PAGE_TOO_LARGE;
+    }
+
+    if (probe_glob != PROBE_OK || memcmp(id_data, &probed_id_glob, sizeof(*id_data)) != 0) {
+        scale_pct = DEFAULT_TIMING_SCALE_PCT;
+    }
+    probed_id_glob = *id_data;
+
+    flash_info_glob = flash_info;
+    row_addr_cycles_glob = flash_info_glob.row_addr_cycles;
+    select_page_kernel(flash_info_glob.page_size_bytes + flash_info_glob.oob_size_bytes);
+    apply_timing(flash_info_glob.timing, scale_pct);
+    return PROBE_OK;
+}
+
+void __time_critical_func(core1_main)()
+{
+
+    cmd_t cmd_arg = { 0, 5 };
+    result_t result = { 0 };
+    int page_num = 0;
+    cache_read_state_t cache_state = { 0 };
+
+    while (1) {
+
+        queue_remove_blocking(&cmd_queue, &cmd_arg);
+        result.alloc = NULL;
+        result.status = RESULT_OK;
+        result.erased = false;
+
+        switch (cmd_arg.cmd) {
+        case CMD_READ_ID:
+            end_cache_read(&pins_glob, &cache_state);
+            result.sz = sizeof(id_data_t);
+            result.alloc = acquire_buffer();
+            result.status = read_id(&pins_glob, (id_data_t*)result.alloc) ? RESULT_OK : RESULT_TIMEOUT;
+            break;
+
+        case CMD_ERASE:
+            end_cache_read(&pins_glob, &cache_state);
+            erase_range(&cmd_arg);
+            continue;
+
+        case CMD_PROGRAM_RANGE:
+            end_cache_read(&pins_glob, &cache_state);
+            program_range(&cmd_arg);
+            continue;
+
+        case CMD_PROBE:
+            end_cache_read(&pins_glob, &cache_state);
+            page_num = 0;
+            result.sz = sizeof(id_data_t);
+            result.alloc = acquire_buffer();
+            probe_glob = probe_nand((id_data_t*)result.alloc);
+            break;
+
+        case CMD_READ_PAGE:
+            read_page_into_buffer(&cache_state, page_num, cmd_arg.arg, &result);
+            page_num += 1;
+            break;
+
+        case CMD_READ_RANGE:
+            if ((cmd_arg.options & DUMP_OPT_SKIP_BAD) && bbt_num_blocks == 0) {
+                end_cache_read(&pins_glob, &cache_state);
+                scan_bad_blocks(&pins_glob, flash_info_glob.num_blocks, flash_info_glob.pages_per_block, flash_info_glob.page_size_bytes);
+            }
+
+            if (cmd_arg.options & DUMP_OPT_STRIPE) {
+                end_cache_read(&pins_glob, &cache_state);
+                read_range_striped(&cmd_arg, &result);
+                page_num = cmd_arg.arg + cmd_arg.count;
+                continue;
+            }
+
+            // cache read already hides tR behind the transfers, otherwise use both planes
+            bool cache_read = (cmd_arg.options & DUMP_OPT_CACHE_READ) && flash_info_glob.cache_read;
+            if (!cache_read && flash_info_glob.num_planes >= 2) {
+                end_cache_read(&pins_glob, &cache_state);
+                read_range_multiplane(&cmd_arg, &cache_state, &result);
+                page_num = cmd_arg.arg + cmd_arg.count;
+                continue;
+            }
+
+            // one result per page, posted as soon as it is read
+            for (uint32_t i = 0; i < cmd_arg.count; i++) {
+                uint32_t page = cmd_arg.arg + i;
+
+                if (!range_page_skipped(&cmd_arg, page, &result)) {
+                    read_page_into_buffer(&cache_state, page, range_read_flags(page, i, cmd_arg.count, cmd_arg.options), &result);
+                }
+                post_range_page(&cmd_arg, &result);
+            }
+            end_cache_read(&pins_glob, &cache_state);
+            page_num = cmd_arg.arg + cmd_arg.count;
+            continue;
+
+        case CMD_RESET_PAGE_NO:
+            result.sz = 1; // TODO make a proper return value
+            page_num = 0;
+
+            break;
+
+        case CMD_SET_PAGE_NO:
             result.sz = 1;
-            result.alloc = 0;
             page_num = (uint32_t)cmd_arg.arg;
 
             break;
+
+        case CMD_SET_READ_MODE:
+            result.sz = 1;
+            read_mode_glob = (read_mode_t)cmd_arg.arg;
+
+            break;
+
+        case CMD_TUNE_TIMING: {
+            end_cache_read(&pins_glob, &cache_state);
+            result.sz = 1;
+            uint8_t* buff = acquire_buffer();
+            tune_timing(&pins_glob, cmd_arg.arg, buff,
+                flash_info_glob.page_size_bytes + flash_info_glob.oob_size_bytes);
+            free_buffer(buff);
+        } break;
+
+        case CMD_SET_TIMING_SCALE:
+            result.sz = 1;
+            apply_timing(timing_glob, cmd_arg.arg);
+            break;
+
+        case CMD_SET_SYS_CLOCK:
+            result.sz = set_sys_clock(cmd_arg.arg) ? 1 : 0;
+            break;
+
+        case CMD_SCAN_BAD_BLOCKS:
+            end_cache_read(&pins_glob, &cache_state);
+            result.sz = scan_bad_blocks(&pins_glob, flash_info_glob.num_blocks, flash_info_glob.pages_per_block, flash_info_glob.page_size_bytes);
+            break;
+
+        case CMD_VOTE_PAGE: {
+            // the count planes take VOTE_PLANES more buffers from the pool, core0 is idle meanwhile
+            uint32_t* planes[VOTE_PLANES];
+            end_cache_read(&pins_glob, &cache_state);
+            result.sz = flash_info_glob.page_size_bytes + flash_info_glob.oob_size_bytes;
+            result.page = cmd_arg.arg;
+            result.alloc = acquire_buffer();
+            for (int p = 0; p < VOTE_PLANES; p++) {
+                planes[p] = (uint32_t*)acquire_buffer();
+            }
+
+            select_chip(&pins_glob, cmd_arg.options);
+            bool ok = vote_page(&pins_glob, cmd_arg.arg, result.alloc, result.sz, cmd_arg.count, planes, &result.unstable_bits);
+            select_chip(&pins_glob, 0);
+            result.status = ok ? RESULT_OK : RESULT_TIMEOUT;
+
+            for (int p = 0; p < VOTE_PLANES; p++) {
+                free_buffer((uint8_t*)planes[p]);
+            }
+        } break;
+
+        case CMD_CAPTURE: {
+            end_cache_read(&pins_glob, &cache_state);
+            result.sz = 1;
+            uint8_t* buff = acquire_buffer();
+            capture_read(&pins_glob, cmd_arg.arg, cmd_arg.count, buff,
+                flash_info_glob.page_size_bytes + flash_info_glob.oob_size_bytes);
+            free_buffer(buff);
+        } break;
+
+        case CMD_BENCH: {
+            end_cache_read(&pins_glob, &cache_state);
+            result.sz = 1;
+            uint8_t* buff = acquire_buffer();
+            run_bench(&pins_glob, (bench_mode_t)cmd_arg.options, cmd_arg.arg, cmd_arg.count, buff,
+                flash_info_glob.page_size_bytes + flash_info_glob.oob_size_bytes);
+            free_buffer(buff);
+        } break;
         default:
             break;
         }
 
+        if (result.status != RESULT_OK) {
+            reset_nand(&pins_glob); // get the chip back to a known state
+        }
+
         queue_add_blocking(&results_queue, &result);
     }
 }
 
 int main()
 {
+    // USB first, so a chip that doesn't probe can still be reported and re-probed
+    stdio_init_all();
 
     // Queue of Results
     queue_init(&results_queue, sizeof(result_t), 20);
@@ -481,35 +2974,30 @@ int main()
     // Command Queue to Core 1 (secondary core)
     queue_init(&cmd_queue, sizeof(cmd_t), 20);
 
+    // Page buffers core1 can fill
+    init_page_buffers();
+    reset_stats();
+
     // Get the chip into a good state
     set_gpios(&pins_glob);
     init_gpios(&pins_glob, GPIO_DRIVE_STRENGTH_2MA);
-    reset_nand(&pins_glob);
-
-    // read some of the config of the chip
+    init_nand_pio(&pins_glob);
+    apply_timing(&TIMING_ONFI_MODES[0], DEFAULT_TIMING_SCALE_PCT); // until we know what chip this is
+#if NAND_SYS_CLOCK_KHZ
+    set_sys_clock(NAND_SYS_CLOCK_KHZ);
+#endif
+    init_crc32_table();
+    init_bch();
+
+    // run again with CMD_PROBE if this one failed (no chip in the socket yet)
     id_data_t id_data = { 0 };
-    read_id(&pins_glob, &id_data);
-
-    if (!check_supported_io_width(&id_data)) {
-        printf("Unsupported I/O width!\n");
-        while (true) {
-            tight_loop_contents();
-        }
-    }
-
-    if (!get_flash_info(&id_data, &flash_info_glob)) {
-        printf("Unrecognized NAND flash ID bytes!\n");
-        while (true) {
-            tight_loop_contents();
-        }
-    }
-
-    sleep_ms(500);
+    probe_glob = probe_nand(&id_data);
 
+    // core1's stack is the SDK's default one at the top of SCRATCH_X, next to
+    // cycles_glob and crc32_table, so core1 only shares the striped banks for
+    // the page buffers (too big for a scratch bank)
     multicore_launch_core1(core1_main);
 
-    stdio_init_all();
-
     bool val = true;
     uint32_t curr_page = 0;
 
@@ -517,49 +3005,64 @@ int main()
         val = (time_us_32() >> 17) & 0x1; // blink about every .262 secs
         gpio_put(LED_PIN, val);
         char c = getchar_timeout_us(0);
+        int cmd = cmd_from_char(c);
         cmd_t cmd_arg;
         cmd_arg.cmd = CMD_NONE;
         cmd_arg.arg = 0;
 
-        if (c >= 0x30 && c <= 0x39) {
-            result_t res = { 0 };
+        if (cmd >= 0 || (c >= 0x20 && c < 0x7f)) {
+            result_t res = { .alloc = NULL };
             gpio_put(LED_PIN, true);
-            switch (c - 0x30) {
+            if (probe_glob != PROBE_OK && cmd_needs_nand(cmd)) {
+                printf("%s, probe again with g\n", PROBE_MESSAGES[probe_glob]);
+                discard_input(); // the command's argument bytes
+                continue;
+            }
+            switch (cmd) {
             case CMD_READ_ID: // read id
+                cancel_prefetch(true);
                 cmd_arg.cmd = CMD_READ_ID;
 
                 queue_add_blocking(&cmd_queue, &cmd_arg);
                 queue_remove_blocking(&results_queue, &res);
 
-                if (res.sz <= 0 || res.sz > sizeof(id_data_t)) {
-                    printf("Error return: %d %p\n", res.sz, shared_buffer);
+                if (res.status != RESULT_OK || res.sz <= 0 || res.sz > sizeof(id_data_t) || !res.alloc) {
+                    printf("Error return: %d %d %d\n", res.status, res.sz, res.alloc != NULL);
                     break;
                 }
                 printf("ID: ");
                 for (int i = 0; i < res.sz; i++) {
-                    printf("%02x ", ((uint8_t*)shared_buffer)[i]);
+                    printf("%02x ", res.alloc[i]);
                 }
                 printf("\n");
 
-                explain_id((id_data_t*)shared_buffer);
+                explain_id((id_data_t*)res.alloc);
                 break;
 
             case CMD_READ_PAGE: // read_page
-                cmd_arg.cmd = CMD_READ_PAGE; // no buffer passed to reduce copying
-
-                queue_add_blocking(&cmd_queue, &cmd_arg);
+                if (!prefetch_pending) {
+                    request_page(0); // no buffer passed to reduce copying
+                }
                 queue_remove_blocking(&results_queue, &res);
+                prefetch_pending = false;
 
-                if (res.sz <= 0 || res.sz > flash_info_glob.page_size_bytes + flash_info_glob.oob_size_bytes) {
+                if (res.status == RESULT_TIMEOUT) {
+                    printf("Error reading page %lu: timed out waiting for RY\n", (unsigned long)res.page);
+                    break;
+                }
+                if (res.sz <= 0 || res.sz > flash_info_glob.page_size_bytes + flash_info_glob.oob_size_bytes || !res.alloc) {
                     printf("Error reading page: %d\n", res.sz);
                     break;
                 }
 
-                display_page(shared_buffer, res.sz);
+                // read the next page into another buffer while this one goes out
+                request_page(0);
+                display_page(res.alloc, res.sz);
                 curr_page += 1;
                 break;
 
             case CMD_RESET_PAGE_NO: // reset
+                cancel_prefetch(false);
                 cmd_arg.cmd = CMD_RESET_PAGE_NO;
                 queue_add_blocking(&cmd_queue, &cmd_arg);
                 queue_remove_blocking(&results_queue, &res); // just pop the result anyway
@@ -579,8 +3082,9 @@ int main()
                     printf("Timed out reading page number\n");
                     break;
                 }
-                uint32_t page_no = (p1 & 0xff) | ((p2 & 0xff) << 8) | ((p3 & 0x1) << 16);
+                uint32_t page_no = (p1 & 0xff) | ((p2 & 0xff) << 8) | ((p3 & 0xff) << 16);
 
+                cancel_prefetch(false);
                 cmd_arg.arg = page_no;
                 queue_add_blocking(&cmd_queue, &cmd_arg);
                 queue_remove_blocking(&results_queue, &res); // just pop the result anyway
@@ -598,13 +3102,283 @@ int main()
             } break;
 
             case CMD_GET_FLASH_INFO:
-                printf("%d,%d,%lld\n", flash_info_glob.page_size_bytes,
+                printf("%d,%d,%lld,%d\n", flash_info_glob.page_size_bytes,
                     flash_info_glob.oob_size_bytes,
-                    flash_info_glob.flash_size_bytes);
+                    flash_info_glob.flash_size_bytes,
+                    pins_glob.num_chips);
+                break;
+
+            case CMD_SET_READ_MODE: {
+                int mode = getchar_timeout_us(2000000);
+                if (PICO_ERROR_TIMEOUT == mode || mode > READ_MODE_PIO) {
+                    printf("Bad read mode\n");
+                    break;
+                }
+
+                cancel_prefetch(true);
+                cmd_arg.cmd = CMD_SET_READ_MODE;
+                cmd_arg.arg = mode;
+                queue_add_blocking(&cmd_queue, &cmd_arg);
+                queue_remove_blocking(&results_queue, &res);
+
+                if (res.sz != 1) {
+                    printf("Error setting read mode %d\n", res.sz);
+                }
+            } break;
+
+            case CMD_DUMP_PAGES: {
+                uint32_t start_page = 0;
+                uint32_t count = 0;
+                uint32_t options = 0;
+                if (!get_arg_bytes(3, &start_page) || !get_arg_bytes(3, &count) || !get_arg_bytes(1, &options)) {
+                    printf("Timed out reading dump range\n");
+                    break;
+                }
+
+                dump_pages(start_page, count, options);
+            } break;
+
+            case CMD_TUNE_TIMING:
+            case CMD_SET_TIMING_SCALE: {
+                uint32_t arg = 0;
+                bool tune = cmd == CMD_TUNE_TIMING;
+                if (!get_arg_bytes(tune ? 3 : 2, &arg)) {
+                    printf("Timed out reading argument\n");
+                    break;
+                }
+                if (!tune && arg < MIN_TIMING_SCALE_PCT) {
+                    printf("Timing scale must be at least %d%%\n", MIN_TIMING_SCALE_PCT);
+                    break;
+                }
+
+                cancel_prefetch(true);
+                cmd_arg.cmd = tune ? CMD_TUNE_TIMING : CMD_SET_TIMING_SCALE;
+                cmd_arg.arg = arg;
+                queue_add_blocking(&cmd_queue, &cmd_arg);
+                queue_remove_blocking(&results_queue, &res);
+
+                printf("Timing scale: %lu%% (PIO clkdiv %.2f)\n", (unsigned long)timing_scale_pct, cycles_glob.pio_clkdiv);
+            } break;
+
+            case CMD_SET_SYS_CLOCK: {
+                uint32_t mhz = 0;
+                if (!get_arg_bytes(2, &mhz)) {
+                    printf("Timed out reading clock\n");
+                    break;
+                }
+
+                cancel_prefetch(true);
+                cmd_arg.cmd = CMD_SET_SYS_CLOCK;
+                cmd_arg.arg = mhz * 1000;
+                queue_add_blocking(&cmd_queue, &cmd_arg);
+                queue_remove_blocking(&results_queue, &res);
+
+                if (res.sz != 1) {
+                    printf("Can't run clk_sys at %lu MHz\n", (unsigned long)mhz);
+                }
+                printf("clk_sys: %lu kHz (PIO clkdiv %.2f)\n", (unsigned long)(clock_get_hz(clk_sys) / 1000), cycles_glob.pio_clkdiv);
+            } break;
+
+            case CMD_GET_STATS: {
+                uint32_t reset = 0;
+                if (!get_arg_bytes(1, &reset)) {
+                    printf("Timed out reading argument\n");
+                    break;
+                }
+
+                cancel_prefetch(true); // core1 must be idle for a consistent snapshot
+                print_stats();
+                if (reset) {
+                    reset_stats();
+                }
+            } break;
+
+            case CMD_SCAN_BAD_BLOCKS:
+                stdio_flush();
+                cancel_prefetch(true);
+                cmd_arg.cmd = CMD_SCAN_BAD_BLOCKS;
+                queue_add_blocking(&cmd_queue, &cmd_arg);
+                queue_remove_blocking(&results_queue, &res);
+
+                for (int c = 0; c < pins_glob.num_chips; c++) {
+                    send_frame(FRAME_BBT, bbt_num_blocks | ((uint32_t)c << FRAME_CHIP_SHIFT), (uint8_t*)bad_block_map[c], (bbt_num_blocks + 7) / 8);
+                }
+                send_frame(FRAME_END, 0, NULL, 0);
+                stream_flush();
+                break;
+
+            case CMD_VOTE_PAGE: {
+                uint32_t page = 0;
+                uint32_t votes = 0;
+                uint32_t chip = 0;
+                if (!get_arg_bytes(3, &page) || !get_arg_bytes(1, &votes) || !get_arg_bytes(1, &chip)) {
+                    printf("Timed out reading argument\n");
+                    break;
+                }
+                if (chip >= pins_glob.num_chips) {
+                    printf("Only %d chips\n", pins_glob.num_chips);
+                    break;
+                }
+                if (votes < 3 || votes > MAX_VOTES || votes % 2 == 0) {
+                    printf("Number of reads must be odd and between 3 and %d\n", MAX_VOTES);
+                    break;
+                }
+
+                stdio_flush();
+                cancel_prefetch(true);
+                cmd_arg.cmd = CMD_VOTE_PAGE;
+                cmd_arg.arg = page;
+                cmd_arg.count = votes;
+                cmd_arg.options = chip;
+                queue_add_blocking(&cmd_queue, &cmd_arg);
+                queue_remove_blocking(&results_queue, &res);
+
+                if (res.status != RESULT_OK || !res.alloc) {
+                    send_frame(FRAME_ERROR, page, NULL, 0);
+                } else {
+                    send_vote_frame(page, res.alloc, res.sz, res.unstable_bits);
+                }
+                stream_flush();
+            } break;
+
+            case CMD_BENCH: {
+                uint32_t mode = 0;
+                uint32_t start = 0;
+                uint32_t count = 0;
+                if (!get_arg_bytes(1, &mode) || !get_arg_bytes(3, &start) || !get_arg_bytes(3, &count)) {
+                    printf("Timed out reading argument\n");
+                    break;
+                }
+                if (mode >= NUM_BENCH_MODES) {
+                    printf("Unknown bench test %lu\n", (unsigned long)mode);
+                    break;
+                }
+
+                cancel_prefetch(true);
+                if (mode == BENCH_USB) {
+                    // frames of the real page size, so the per frame overhead is the same as in a dump
+                    uint32_t sz = flash_info_glob.page_size_bytes + flash_info_glob.oob_size_bytes;
+                    uint8_t* buff = acquire_buffer();
+                    for (uint32_t i = 0; i < sz; i++) {
+                        buff[i] = i;
+                    }
+                    uint32_t crc = crc32(buff, sz);
+
+                    memset(&bench_glob, 0, sizeof(bench_glob));
+                    bench_glob.min_us = UINT32_MAX;
+                    stdio_flush();
+                    for (uint32_t i = 0; i < count; i++) {
+                        uint32_t frame_start = time_us_32();
+                        if (!send_frame_crc(FRAME_PAGE, start + i, buff, sz, crc)) {
+                            bench_glob.timeouts++;
+                            break;
+                        }
+                        bench_add(&bench_glob, time_us_32() - frame_start, sz + sizeof(frame_hdr_t));
+                    }
+                    send_frame(FRAME_END, start + count, NULL, 0);
+                    stream_flush();
+                    free_buffer(buff);
+                } else {
+                    cmd_arg.cmd = CMD_BENCH;
+                    cmd_arg.arg = start;
+                    cmd_arg.count = count;
+                    cmd_arg.options = mode;
+                    queue_add_blocking(&cmd_queue, &cmd_arg);
+                    queue_remove_blocking(&results_queue, &res);
+                }
+                print_bench(mode, &bench_glob);
+            } break;
+
+            case CMD_CAPTURE: {
+                uint32_t page = 0;
+                uint32_t clkdiv = 0;
+                if (!get_arg_bytes(3, &page) || !get_arg_bytes(2, &clkdiv)) {
+                    printf("Timed out reading argument\n");
+                    break;
+                }
+                if (clkdiv == 0) {
+                    printf("Clock divider must be at least 1\n");
+                    break;
+                }
+
+                stdio_flush();
+                cancel_prefetch(true);
+                cmd_arg.cmd = CMD_CAPTURE;
+                cmd_arg.arg = page;
+                cmd_arg.count = clkdiv;
+                queue_add_blocking(&cmd_queue, &cmd_arg);
+                queue_remove_blocking(&results_queue, &res);
+
+                capture_hdr_t* hdr = (capture_hdr_t*)capture_buffer;
+                send_frame(FRAME_CAPTURE, page, (uint8_t*)capture_buffer, sizeof(*hdr) + hdr->num_samples * 4);
+                stream_flush();
+            } break;
+            case CMD_ERASE: {
+                uint32_t start = 0;
+                uint32_t count = 0;
+                if (!get_arg_bytes(3, &start) || !get_arg_bytes(3, &count)) {
+                    printf("Timed out reading argument\n");
+                    break;
+                }
+                if (start + count > flash_info_glob.num_blocks) {
+                    send_frame(FRAME_ERROR, start, NULL, 0); // nothing erased
+                    send_frame(FRAME_END, start + count, NULL, 0);
+                    stream_flush();
+                    break;
+                }
+
+                stdio_flush();
+                cancel_prefetch(true);
+                cmd_arg.cmd = CMD_ERASE;
+                cmd_arg.arg = start;
+                cmd_arg.count = count;
+                queue_add_blocking(&cmd_queue, &cmd_arg);
+                for (uint32_t i = 0; i < count; i++) {
+                    queue_remove_blocking(&results_queue, &res);
+                    send_program_result(&res);
+                }
+                send_frame(FRAME_END, start + count, NULL, 0);
+                stream_flush();
+            } break;
+
+            case CMD_PROGRAM: {
+                uint32_t start = 0;
+                uint32_t count = 0;
+                uint32_t options = 0;
+                if (!get_arg_bytes(3, &start) || !get_arg_bytes(3, &count) || !get_arg_bytes(1, &options)) {
+                    printf("Timed out reading argument\n");
+                    break;
+                }
+                if (start + count > flash_info_glob.num_blocks * flash_info_glob.pages_per_block) {
+                    discard_input(); // the pages
+                    send_frame(FRAME_ERROR, start, NULL, 0); // nothing programmed
+                    send_frame(FRAME_END, start + count, NULL, 0);
+                    stream_flush();
+                    break;
+                }
+                program_pages(start, count, options);
+            } break;
+
+            case CMD_PROBE:
+                cancel_prefetch(true);
+                cmd_arg.cmd = CMD_PROBE;
+                queue_add_blocking(&cmd_queue, &cmd_arg);
+                queue_remove_blocking(&results_queue, &res);
+
+                printf("Probe: %s, ID ", PROBE_MESSAGES[probe_glob]);
+                for (int i = 0; i < res.sz; i++) {
+                    printf("%02x ", res.alloc[i]);
+                }
+                printf("chips %d\n", probe_glob == PROBE_OK ? pins_glob.num_chips : 0);
                 break;
+
             default:
+                if (probe_glob != PROBE_OK) {
+                    printf("%s!\n", PROBE_MESSAGES[probe_glob]);
+                }
                 printf("%s", HELP_STR);
             }
+            release_buffer(&res); // ID or page the command returned, if any
         }
     }
     return 0;